@@ -1,3 +1,3 @@
+// Flags are now found through linker-defined section bounds, so this file is
+// no longer needed.  It's kept empty for builds that still link it first.
 #include "xflags.h"
-
-const ::xflags::FlagInfo* ::xflags::begin XFLAGS_SECTION = nullptr;
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Generates translation units exporting COUNT flags of mixed types, for use by
+# xflags-bench.  The flags are spread over files of 250 flags each, like in a
+# real program, and because compilers handle very large translation units full
+# of global constructors poorly.  DIRECTORY/main.cc holds the command line
+# used by the benchmarks.
+#
+# Usage: xflags-bench-gen.sh COUNT DIRECTORY
+
+if [ $# -ne 2 ]; then
+  echo "Usage: $0 COUNT DIRECTORY" >&2
+  exit 64
+fi
+
+mkdir -p "$2" || exit 1
+
+exec awk -v count="$1" -v directory="$2" 'BEGIN {
+  split("int32_t uint64_t double float bool std::string std::vector<int64_t> std::vector<double>", types, " ")
+  split("int32 uint64 double float bool string int64_list double_list", kinds, " ")
+  split("12345 18446744073709551615 2.718281828 0.125 true hello,world 1,2,3,4,5,6,7,8 0.5,1.5,2.5,3.5", values, " ")
+  split("N N X X - STRING LIST LIST", placeholders, " ")
+
+  header = "// Generated by xflags-bench-gen.sh; do not edit.\n\n" \
+           "#include <cstdint>\n#include <string>\n#include <vector>\n\n" \
+           "#include \"xflags.h\"\n"
+
+  for (i = 0; i < count; ++i) {
+    if (i % 250 == 0) {
+      if (file) close(file)
+      file = directory "/flags-" (i / 250) ".cc"
+      print header > file
+    }
+    t = i % 8 + 1
+    name = kinds[t] "_flag_" i
+    placeholder = (placeholders[t] == "-") ? "nullptr" : "\"" placeholders[t] "\""
+    printf "%s %s;\n", types[t], name > file
+    printf "XFLAGS_EXPORT(%s, %s, \"synthetic %s flag number %d\");\n\n", name, placeholder, kinds[t], i > file
+  }
+  if (file) close(file)
+
+  file = directory "/main.cc"
+  print header > file
+
+  print "extern const char* const bench_arguments[] = {" > file
+  for (i = 0; i < count; ++i) {
+    t = i % 8 + 1
+    printf "    \"--%s_flag_%d=%s\",\n", kinds[t], i, values[t] > file
+  }
+  print "    nullptr};\n" > file
+
+  # Reset through tables of pointers rather than one statement per flag,
+  # which makes the compiler spend minutes on large counts.
+  for (t = 7; t <= 8; ++t) {
+    for (i = t - 1; i < count; i += 8) printf "extern %s %s_flag_%d;\n", types[t], kinds[t], i > file
+    printf "\n%s* const %s_flags[] = {\n", types[t], kinds[t] > file
+    for (i = t - 1; i < count; i += 8) printf "    &%s_flag_%d,\n", kinds[t], i > file
+    print "    nullptr};\n" > file
+  }
+
+  print "// Empties the list flags and releases their storage, so that repeated" > file
+  print "// parsing neither grows them nor hides their allocations." > file
+  print "void bench_reset() {" > file
+  print "  for (auto flag = int64_list_flags; *flag; ++flag)" > file
+  print "    std::vector<int64_t>().swap(**flag);" > file
+  print "  for (auto flag = double_list_flags; *flag; ++flag)" > file
+  print "    std::vector<double>().swap(**flag);" > file
+  print "}" > file
+}'
@@ -0,0 +1,390 @@
+// Benchmarks for the xflags library.
+//
+// This program is linked with a generated translation unit exporting a fixed
+// number of flags; see xflags-bench-gen.sh and `make bench`.  It measures
+// parsing, help rendering and completion, and prints one line per benchmark
+// with the time, heap allocations and allocated bytes per operation.  The
+// `/threads` benchmarks report the time per operation and core while one
+// thread per core runs.
+//
+// Usage: xflags-bench [XFLAGS-COMPLETE]
+//
+// If the path to xflags-complete is given, its run time against this
+// executable is measured as well.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "xflags.h"
+
+// Defined by the generated translation unit.
+extern const char* const bench_arguments[];
+void bench_reset();
+
+namespace {
+
+std::atomic<size_t> allocation_count{0};
+std::atomic<size_t> allocation_bytes{0};
+
+}  // namespace
+
+void* operator new(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (void* result = std::malloc(size ? size : 1)) return result;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Measurement {
+  size_t iterations;
+  double ns;
+  double allocations;
+  double bytes;
+};
+
+// Runs `function` repeatedly for about `budget`, and returns the average time,
+// allocation count and allocated bytes per call.
+template <typename Function>
+Measurement measure(Function&& function,
+                    Clock::duration budget = std::chrono::milliseconds(500)) {
+  // Warm up caches and lazily built tables.
+  function();
+
+  size_t iterations = 0;
+  const auto allocations_before = allocation_count.load();
+  const auto bytes_before = allocation_bytes.load();
+  const auto start = Clock::now();
+  Clock::duration elapsed;
+
+  do {
+    function();
+    ++iterations;
+    elapsed = Clock::now() - start;
+  } while (elapsed < budget);
+
+  const auto ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  return Measurement{
+      iterations, static_cast<double>(ns) / iterations,
+      static_cast<double>(allocation_count - allocations_before) / iterations,
+      static_cast<double>(allocation_bytes - bytes_before) / iterations};
+}
+
+// Runs `function` on `thread_count` threads at once for about `budget`, and
+// returns the average time per call and thread.  Each thread passes its own
+// state, made by `make_state`, to `function`.
+template <typename MakeState, typename Function>
+Measurement measure_threads(
+    unsigned thread_count, MakeState&& make_state, Function&& function,
+    Clock::duration budget = std::chrono::milliseconds(500)) {
+  std::atomic<size_t> iterations{0};
+  std::atomic<bool> stop{false};
+  const auto allocations_before = allocation_count.load();
+  const auto bytes_before = allocation_bytes.load();
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < thread_count; ++i) {
+    threads.emplace_back([&] {
+      auto state = make_state();
+      function(state);
+      size_t count = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        function(state);
+        ++count;
+      }
+      iterations += count;
+    });
+  }
+
+  std::this_thread::sleep_for(budget);
+  stop = true;
+  for (auto& thread : threads) thread.join();
+
+  // Includes the warm-up calls, which are few.
+  const double calls = iterations + thread_count;
+  const auto ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(budget).count();
+  return Measurement{
+      iterations.load(), ns * thread_count / calls,
+      (allocation_count - allocations_before) / calls,
+      (allocation_bytes - bytes_before) / calls};
+}
+
+// Like `measure`, but with stdout redirected to `fd`.
+template <typename Function>
+Measurement measure_with_stdout(int fd, Function&& function) {
+  std::fflush(stdout);
+  std::cout.flush();
+  const int stdout_fd = dup(STDOUT_FILENO);
+  dup2(fd, STDOUT_FILENO);
+
+  const auto result = measure(function);
+
+  dup2(stdout_fd, STDOUT_FILENO);
+  close(stdout_fd);
+  return result;
+}
+
+void report(const char* name, const Measurement& result) {
+  std::printf("%-32s %10zu %14.1f %12.1f %14.1f\n", name, result.iterations,
+              result.ns, result.allocations, result.bytes);
+}
+
+template <typename Function>
+void run(const char* name, Function&& function) {
+  report(name, measure(function));
+}
+
+// Runs `argv` with stdout redirected to /dev/null and returns its resource
+// usage.
+rusage run_child(char* const* argv) {
+  const pid_t pid = fork();
+  if (pid == -1) err(EX_OSERR, "fork failed");
+
+  if (pid == 0) {
+    const int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd != -1) dup2(null_fd, STDOUT_FILENO);
+    execv(argv[0], argv);
+    _exit(EX_OSERR);
+  }
+
+  int status;
+  rusage usage;
+  if (-1 == wait4(pid, &status, 0, &usage)) err(EX_OSERR, "wait4 failed");
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    errx(EX_SOFTWARE, "'%s' failed", argv[0]);
+
+  return usage;
+}
+
+// Returns the value of the first flag named `<kind>_flag_<N>`, or 0.
+int find_flag(const std::vector<option>& options, const char* kind) {
+  const auto length = std::strlen(kind);
+  for (const auto& option : options) {
+    if (0 == std::strncmp(option.name, kind, length) &&
+        0 == std::strncmp(option.name + length, "_flag_", 6))
+      return option.val;
+  }
+  return 0;
+}
+
+// Returns the benchmark command line.  If `scalars_only` is true, the list
+// flags, whose parsers allocate memory, are left out.
+std::vector<char*> arguments(const char* program, bool scalars_only = false) {
+  std::vector<char*> result;
+  result.emplace_back(const_cast<char*>(program));
+  for (auto arg = bench_arguments; *arg; ++arg) {
+    if (scalars_only && std::strstr(*arg, "_list_flag_")) continue;
+    result.emplace_back(const_cast<char*>(*arg));
+  }
+  result.emplace_back(nullptr);
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  // Child mode, used to measure process startup.
+  if (getenv("XFLAGS_BENCH_CHILD")) {
+    xflags::parse(argc, argv);
+    return EXIT_SUCCESS;
+  }
+
+  char self[4096];
+  const auto self_length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (self_length == -1) err(EX_OSERR, "readlink /proc/self/exe failed");
+  self[self_length] = '\0';
+
+  auto scalar_args = arguments(argv[0], true);
+
+  const auto options = xflags::get_options();
+  std::printf("%zu flags\n\n", options.size());
+  std::printf("%-32s %10s %14s %12s %14s\n", "benchmark", "iterations",
+              "ns/op", "allocs/op", "bytes/op");
+
+  run("parse", [&] {
+    auto args = arguments(argv[0]);
+    xflags::parse(args.size() - 1, args.data());
+    bench_reset();
+  });
+
+  run("parse/scalars", [&] {
+    xflags::parse(scalar_args.size() - 1, scalar_args.data());
+  });
+
+  // `FlagSet` parses into per-call storage, so reusing a `FlagValues` per
+  // thread makes later calls allocate nothing for scalar flags.
+  const xflags::FlagSet flag_set;
+  auto flag_set_parse = [&flag_set](const std::vector<char*>& args,
+                                    xflags::FlagValues& values) {
+    std::string error;
+    if (!flag_set.parse(args.size() - 1, args.data(), values, error))
+      errx(EX_SOFTWARE, "FlagSet::parse failed: %s", error.c_str());
+  };
+
+  const auto all_args = arguments(argv[0]);
+  {
+    xflags::FlagValues values;
+    run("flagset/parse", [&] { flag_set_parse(all_args, values); });
+    run("flagset/parse/scalars", [&] { flag_set_parse(scalar_args, values); });
+  }
+
+  const unsigned thread_count =
+      std::max(1u, std::thread::hardware_concurrency());
+  const auto threads_name =
+      "flagset/parse/" + std::to_string(thread_count) + "_threads";
+  report(threads_name.c_str(),
+         measure_threads(
+             thread_count, [] { return xflags::FlagValues(); },
+             [&](xflags::FlagValues& values) {
+               flag_set_parse(all_args, values);
+             }));
+
+  run("get_options", [] { xflags::get_options(); });
+
+  static const char* const kinds[][2] = {
+      {"int32", "12345"},
+      {"uint64", "18446744073709551615"},
+      {"double", "2.718281828"},
+      {"float", "0.125"},
+      {"bool", "true"},
+      {"string", "hello,world"},
+  };
+
+  for (const auto& kind : kinds) {
+    const auto val = find_flag(options, kind[0]);
+    if (!val) continue;
+    const std::string name = std::string("parse_flag/") + kind[0];
+    run(name.c_str(), [&] { xflags::parse_flag(val, kind[1]); });
+  }
+
+  std::string int64_list, double_list;
+  for (int i = 0; i < 100000; ++i) {
+    if (i) {
+      int64_list += ',';
+      double_list += ',';
+    }
+    int64_list += std::to_string(i * INT64_C(7919));
+    double_list += std::to_string(i * 0.001);
+  }
+
+  if (const auto val = find_flag(options, "int64_list")) {
+    run("parse_flag/int64_list[100000]", [&] {
+      xflags::parse_flag(val, int64_list.c_str());
+      bench_reset();
+    });
+  }
+
+  if (const auto val = find_flag(options, "double_list")) {
+    run("parse_flag/double_list[100000]", [&] {
+      xflags::parse_flag(val, double_list.c_str());
+      bench_reset();
+    });
+  }
+
+  auto print_help = [] {
+    xflags::print_help();
+    std::cout.flush();
+  };
+
+  {
+    // Render help into /dev/null.
+    const int null_fd = open("/dev/null", O_WRONLY);
+    report("print_help", measure_with_stdout(null_fd, print_help));
+    close(null_fd);
+  }
+
+  {
+    // Help text is only rendered again when the terminal width changes, so
+    // the above mostly measures write(2).  Writing to a pseudo-terminal
+    // whose width changes on every call measures rendering too; the cost of
+    // writing alone is measured with a fixed width.
+    const int master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd == -1 || 0 != grantpt(master_fd) ||
+        0 != unlockpt(master_fd))
+      err(EX_OSERR, "Failed to create pseudo-terminal");
+    const int terminal_fd = open(ptsname(master_fd), O_WRONLY | O_NOCTTY);
+    if (terminal_fd == -1) err(EX_OSERR, "Failed to open pseudo-terminal");
+
+    termios attributes;
+    if (0 == tcgetattr(terminal_fd, &attributes)) {
+      cfmakeraw(&attributes);
+      tcsetattr(terminal_fd, TCSANOW, &attributes);
+    }
+
+    // Reading fails once the terminal is closed.
+    std::thread reader([master_fd] {
+      char buffer[65536];
+      while (read(master_fd, buffer, sizeof(buffer)) > 0) {
+      }
+    });
+
+    winsize size;
+    std::memset(&size, 0, sizeof(size));
+    size.ws_col = 80;
+    ioctl(terminal_fd, TIOCSWINSZ, &size);
+    report("print_help/terminal", measure_with_stdout(terminal_fd, print_help));
+
+    report("print_help/terminal/uncached",
+           measure_with_stdout(terminal_fd, [&] {
+             size.ws_col = (size.ws_col == 80) ? 81 : 80;
+             ioctl(terminal_fd, TIOCSWINSZ, &size);
+             print_help();
+           }));
+
+    close(terminal_fd);
+    reader.join();
+    close(master_fd);
+  }
+
+  std::fflush(stdout);
+
+  // Process startup, including parsing the full command line.
+  setenv("XFLAGS_BENCH_CHILD", "1", 1);
+  auto args = arguments(self);
+  long child_rss = 0;
+  run("startup", [&] {
+    const auto usage = run_child(args.data());
+    if (usage.ru_maxrss > child_rss) child_rss = usage.ru_maxrss;
+  });
+
+  // Process startup without arguments, dominated by loading the program.
+  char* no_args[] = {self, nullptr};
+  run("startup/no_args", [&] { run_child(no_args); });
+  unsetenv("XFLAGS_BENCH_CHILD");
+
+  if (argc > 1) {
+    char* complete_args[] = {argv[1], self, nullptr};
+    run("xflags-complete", [&] { run_child(complete_args); });
+  }
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  std::printf("\nmax RSS: %ld KiB (startup child: %ld KiB)\n",
+              usage.ru_maxrss, child_rss);
+}
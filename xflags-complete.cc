@@ -1,15 +1,27 @@
 #include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <thread>
 
+#include <dirent.h>
 #include <elf.h>
 #include <err.h>
 #include <fcntl.h>
-#include <sys/mman.h>
+#include <glob.h>
+#include <sys/stat.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "xflags-index.h"
 #include "xflags.h"
 
 namespace {
@@ -20,10 +32,20 @@ bool help;
 // Print version information and exit.
 bool version;
 
+// Use the completion cache.
+bool cache = true;
+
+// Include flags from the shared libraries the program depends on.
+bool libraries;
+
 }  // namespace
 
 XFLAGS_EXPORT(help, nullptr, "print this help and exit");
 XFLAGS_EXPORT(version, nullptr, "print version information and exit");
+XFLAGS_EXPORT(cache, nullptr, "use the completion cache (default)");
+XFLAGS_EXPORT(libraries, nullptr,
+              "include flags from the shared libraries the program depends "
+              "on");
 
 template <typename ElfType>
 struct ElfClasses {};
@@ -31,114 +53,846 @@ struct ElfClasses {};
 template <>
 struct ElfClasses<Elf32_Ehdr> {
   using Section = Elf32_Shdr;
+  using Dynamic = Elf32_Dyn;
 };
 
 template <>
 struct ElfClasses<Elf64_Ehdr> {
   using Section = Elf64_Shdr;
+  using Dynamic = Elf64_Dyn;
+};
+
+// The parts of an ELF file we're interested in.
+struct ElfFile {
+  unsigned char elf_class = ELFCLASSNONE;
+  uint16_t machine = EM_NONE;
+
+  // The `.xflags-names` section, and the offsets of the names of the exported
+  // flags in it.
+  std::string names;
+  std::vector<uint32_t> offsets;
+
+  // True if `offsets` came from a valid `.xflags-index` section, and are
+  // thus sorted by name and free of duplicates.
+  bool indexed = false;
+
+  // The DT_NEEDED, DT_RPATH and DT_RUNPATH entries.
+  std::vector<std::string> needed;
+  std::string rpath, runpath;
 };
 
+// Reads parts of an ELF file with pread, so that only the headers and the
+// sections we're interested in are read, and never past the end of the file.
+class ElfReader {
+ public:
+  ElfReader(int fd, uint64_t size) : fd_(fd), size_(size) {}
+
+  // Reads `length` bytes at `offset` into `out`.  Returns false if they are
+  // not all inside the file, or can't be read.
+  bool read(uint64_t offset, uint64_t length, void* out) const {
+    if (offset > size_ || length > size_ - offset) return false;
+    auto ptr = static_cast<char*>(out);
+    while (length > 0) {
+      const auto ret = pread(fd_, ptr, length, offset);
+      if (ret == -1 && errno == EINTR) continue;
+      if (ret <= 0) return false;
+      ptr += ret;
+      offset += ret;
+      length -= ret;
+    }
+    return true;
+  }
+
+  bool read(uint64_t offset, uint64_t length, std::string& out) const {
+    if (offset > size_ || length > size_ - offset) return false;
+    out.resize(length);
+    return read(offset, length, &out[0]);
+  }
+
+  // Reads a string table, making sure that its last string is terminated.
+  bool read_strings(uint64_t offset, uint64_t length, std::string& out) const {
+    if (!read(offset, length, out)) return false;
+    out.push_back('\0');
+    return true;
+  }
+
+ private:
+  int fd_;
+  uint64_t size_;
+};
+
+// Returns the string at `offset` in the string table `strings`, or nullptr if
+// it's out of bounds.
+const char* string_at(const std::string& strings, uint64_t offset) {
+  return offset < strings.size() ? strings.data() + offset : nullptr;
+}
+
+// Reads the sections we're interested in from the ELF file with the header
+// `header`.  Returns false if the file is corrupt or truncated.
 template <typename ElfType>
-std::vector<std::string> parse_elf(const ElfType* data) {
+bool parse_elf(const ElfReader& file, const ElfType& header,
+               ElfFile& result) {
   using Section = typename ElfClasses<ElfType>::Section;
+  using Dynamic = typename ElfClasses<ElfType>::Dynamic;
+
+  result.machine = header.e_machine;
+
+  // Files without section headers, like some stripped programs, export no
+  // flags we can find.
+  if (header.e_shoff == 0) return true;
+  if (header.e_shentsize < sizeof(Section)) return false;
+
+  Section first = Section();
+  if ((header.e_shnum == 0 || header.e_shstrndx == SHN_XINDEX) &&
+      !file.read(header.e_shoff, sizeof(first), &first))
+    return false;
+  uint64_t section_count, strings_index;
+  xflags_section_counts(header, first, section_count, strings_index);
+  if (strings_index >= section_count) return false;
+
+  std::string table;
+  if (!file.read(header.e_shoff, section_count * header.e_shentsize, table))
+    return false;
+
+  auto section_at = [&](uint64_t i) {
+    Section section;
+    std::memcpy(&section, &table[i * header.e_shentsize], sizeof(section));
+    return section;
+  };
+
+  const auto strings_section = section_at(strings_index);
+  std::string strings;
+  if (strings_section.sh_type != SHT_STRTAB ||
+      !file.read_strings(strings_section.sh_offset, strings_section.sh_size,
+                         strings))
+    return false;
+
+  Section names = Section(), index = Section();
+  bool has_names = false, has_index = false;
+
+  for (uint64_t i = 0; i < section_count; ++i) {
+    const auto section = section_at(i);
+
+    if (section.sh_type == SHT_DYNAMIC && section.sh_link < section_count) {
+      const auto dynamic_strings_section = section_at(section.sh_link);
+      std::string dynamic, dynamic_strings;
+      if (!file.read(section.sh_offset, section.sh_size, dynamic) ||
+          !file.read_strings(dynamic_strings_section.sh_offset,
+                             dynamic_strings_section.sh_size,
+                             dynamic_strings))
+        return false;
+
+      const auto entry_count = dynamic.size() / sizeof(Dynamic);
+      for (size_t j = 0; j < entry_count; ++j) {
+        Dynamic entry;
+        std::memcpy(&entry, &dynamic[j * sizeof(entry)], sizeof(entry));
+        if (entry.d_tag == DT_NULL) break;
+
+        const char* value = string_at(dynamic_strings, entry.d_un.d_val);
+        if (!value) continue;
+        switch (entry.d_tag) {
+          case DT_NEEDED:
+            result.needed.emplace_back(value);
+            break;
+          case DT_RPATH:
+            result.rpath = value;
+            break;
+          case DT_RUNPATH:
+            result.runpath = value;
+            break;
+        }
+      }
+    }
 
-  auto base = reinterpret_cast<const char*>(data);
+    const char* name = string_at(strings, section.sh_name);
+    if (!name || section.sh_type == SHT_NOBITS) continue;
+    if (0 == std::strcmp(name, ".xflags-names")) {
+      names = section;
+      has_names = true;
+    } else if (0 == std::strcmp(name, XFLAGS_INDEX_SECTION)) {
+      index = section;
+      has_index = true;
+    }
+  }
+
+  if (!has_names) return true;
+
+  auto& names_data = result.names;
+  if (!file.read(names.sh_offset, names.sh_size, names_data)) return false;
+
+  // A missing or truncated index is ignored, like a stale one.  A valid one
+  // is used as is, so no name needs to be copied or compared.
+  std::string index_data;
+  uint32_t count;
+  const char* offsets =
+      has_index && file.read(index.sh_offset, index.sh_size, index_data)
+          ? xflags_index_offsets(index_data.data(), index_data.size(),
+                                 names_data.data(), names_data.size(), count)
+          : nullptr;
+  if (offsets) {
+    result.offsets.resize(count);
+    for (uint32_t i = 0; i < count; ++i)
+      result.offsets[i] = xflags_index_offset(offsets, i);
+    result.indexed = true;
+    return true;
+  }
 
-  auto string_table = reinterpret_cast<const Section*>(
-      base + data->e_shoff + data->e_shentsize * data->e_shstrndx);
-  if (string_table->sh_type != SHT_STRTAB)
-    errx(EX_DATAERR, "Corrupt string table");
-  auto strings = base + string_table->sh_offset;
+  // Makes sure the last name is terminated.
+  names_data.push_back('\0');
+  for (size_t i = 0; i < names_data.size(); ++i) {
+    if (names_data[i] == '\0') continue;
+    result.offsets.emplace_back(i);
+    i += std::strlen(&names_data[i]);
+  }
 
-  auto section = reinterpret_cast<const Section*>(base + data->e_shoff);
+  return true;
+}
 
-  for (size_t i = 0; i < data->e_shnum; ++i) {
-    if (0 == std::strcmp(strings + section->sh_name, ".xflags-names")) {
-      const char* begin = base + section->sh_offset;
-      const char* end = begin + section->sh_size;
+namespace {
 
-      std::vector<std::string> result;
+// Returns the modification time of `st` in nanoseconds.
+uint64_t mtime_ns(const struct stat& st) {
+  return static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 +
+         st.st_mtim.tv_nsec;
+}
 
-      while (begin != end) {
-        if (*begin == '\0') {
-          ++begin;
-          continue;
-        }
+// Identifies a version of a file flags were read from.
+struct FileStamp {
+  std::string path;
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  uint64_t mtime_ns;
+};
 
-        const char* segment_end = begin + 1;
-        while (segment_end != end && *segment_end != '\0') ++segment_end;
+FileStamp make_stamp(const std::string& path, const struct stat& st) {
+  return FileStamp{path, static_cast<uint64_t>(st.st_dev),
+                   static_cast<uint64_t>(st.st_ino),
+                   static_cast<uint64_t>(st.st_size), mtime_ns(st)};
+}
 
-        std::string argument = "--";
-        argument.append(begin, segment_end);
-        result.emplace_back(std::move(argument));
+// A set of flags loaded from the cache or from ELF files.  `offsets` point
+// to NUL-terminated flag names in `names`, like "help" for "--help", and are
+// sorted by name.  `files` lists the files the flags were read from,
+// starting with the executable.
+struct FlagList {
+  std::vector<FileStamp> files;
+  std::string names;
+  std::vector<uint32_t> offsets;
+
+  size_t size() const { return offsets.size(); }
+  const char* operator[](size_t i) const { return names.data() + offsets[i]; }
+};
 
-        begin = segment_end;
-      }
+// Completion cache.
+//
+// Each cache file holds the flags of one executable, as a `FlagList`.  Cache
+// files are named after a hash of `key`, which holds everything used to find
+// the files: the command name, $PATH or the working directory where
+// relevant, and $LD_LIBRARY_PATH if shared libraries are included.  An
+// entry is only used if all files it was built from, and the directories
+// searched for them, still have the same device, inode, size and
+// modification time.
+//
+// Entries are written to a temporary file and renamed into place, so
+// concurrent shells never see partial entries.  When there are more than
+// `kMaxCacheEntries` entries, the oldest ones are removed.
+
+const size_t kMaxCacheEntries = 256;
+const size_t kMaxCacheEntrySize = 16 << 20;
+const char kCacheMagic[8] = {'X', 'F', 'L', 'G', 'C', 'M', 'P', '3'};
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t key_length;
+  uint32_t file_count;
+  uint32_t name_count;
+  uint32_t names_length;
+};
+
+struct CacheFile {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint32_t path_length;
+};
+
+// Returns the directory holding cache entries, or an empty string if there
+// is none.
+std::string cache_directory() {
+  std::string result;
+  if (const char* cache_home = getenv("XDG_CACHE_HOME")) {
+    result = cache_home;
+  } else if (const char* home = getenv("HOME")) {
+    result = home;
+    result += "/.cache";
+  } else {
+    return result;
+  }
+  mkdir(result.c_str(), 0700);
+  result += "/xflags-complete";
+  if (-1 == mkdir(result.c_str(), 0700) && errno != EEXIST) result.clear();
+  return result;
+}
+
+// Returns the name of the cache entry for `key`.
+std::string cache_path(const std::string& directory, const std::string& key) {
+  uint64_t hash = UINT64_C(14695981039346656037);
+  for (auto ch : key) {
+    hash ^= static_cast<unsigned char>(ch);
+    hash *= UINT64_C(1099511628211);
+  }
+  char name[20];
+  std::snprintf(name, sizeof(name), "/%016llx",
+                static_cast<unsigned long long>(hash));
+  return directory + name;
+}
 
-      return result;
+// Loads the flags cached for `key`.  Returns false if there is no valid entry.
+bool load_cache(const std::string& path, const std::string& key,
+                FlagList& result) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat st;
+  std::string data;
+  if (0 == fstat(fd, &st) &&
+      static_cast<size_t>(st.st_size) >= sizeof(CacheHeader) &&
+      static_cast<size_t>(st.st_size) <= kMaxCacheEntrySize) {
+    data.resize(st.st_size);
+    if (read(fd, &data[0], data.size()) != st.st_size) data.clear();
+  }
+  close(fd);
+  if (data.empty()) return false;
+
+  const char* ptr = data.data();
+  const char* end = data.data() + data.size();
+
+  CacheHeader header;
+  std::memcpy(&header, ptr, sizeof(header));
+  ptr += sizeof(header);
+  if (0 != std::memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)))
+    return false;
+
+  if (header.key_length != key.size() ||
+      static_cast<size_t>(end - ptr) < key.size() ||
+      0 != key.compare(0, key.size(), ptr, key.size()))
+    return false;
+  ptr += key.size();
+
+  for (uint32_t i = 0; i < header.file_count; ++i) {
+    CacheFile file;
+    if (static_cast<size_t>(end - ptr) < sizeof(file)) return false;
+    std::memcpy(&file, ptr, sizeof(file));
+    ptr += sizeof(file);
+    if (static_cast<size_t>(end - ptr) < file.path_length) return false;
+
+    FileStamp stamp{std::string(ptr, file.path_length), file.device,
+                    file.inode, file.size, file.mtime_ns};
+    ptr += file.path_length;
+
+    // Paths that didn't exist have inode 0, and must still not exist.
+    struct stat file_st;
+    if (-1 == stat(stamp.path.c_str(), &file_st)) {
+      if (stamp.inode != 0) return false;
+    } else if (static_cast<uint64_t>(file_st.st_dev) != stamp.device ||
+               static_cast<uint64_t>(file_st.st_ino) != stamp.inode ||
+               static_cast<uint64_t>(file_st.st_size) != stamp.size ||
+               mtime_ns(file_st) != stamp.mtime_ns) {
+      return false;
     }
 
-    section = reinterpret_cast<const Section*>(
-        reinterpret_cast<const char*>(section) + data->e_shentsize);
+    result.files.emplace_back(std::move(stamp));
+  }
+
+  if (result.files.empty() ||
+      static_cast<uint64_t>(end - ptr) !=
+          uint64_t(header.name_count) * 4 + header.names_length)
+    return false;
+
+  result.offsets.resize(header.name_count);
+  std::memcpy(result.offsets.data(), ptr, header.name_count * 4);
+  ptr += header.name_count * 4;
+  result.names.assign(ptr, header.names_length);
+
+  for (auto offset : result.offsets) {
+    if (offset >= result.names.size()) return false;
   }
+  if (!result.names.empty() && result.names.back() != '\0') return false;
 
-  return {};
+  return true;
 }
 
-int main(int argc, char** argv) {
-  std::string executable, filter;
-  std::string prev_argument;
+// Removes the oldest entries if the cache holds too many.
+void trim_cache(const std::string& directory) {
+  DIR* dir = opendir(directory.c_str());
+  if (!dir) return;
+
+  std::vector<std::pair<uint64_t, std::string>> entries;
+  while (const dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') continue;
+    struct stat st;
+    if (0 == fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW))
+      entries.emplace_back(mtime_ns(st), entry->d_name);
+  }
 
-  if (getenv("COMP_LINE")) {
-    executable = getenv("COMP_LINE");
+  if (entries.size() > kMaxCacheEntries) {
+    std::sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size() - kMaxCacheEntries; ++i)
+      unlinkat(dirfd(dir), entries[i].second.c_str(), 0);
+  }
 
-    auto space = executable.find(' ');
-    if (space != std::string::npos)
-      executable.erase(space);
+  closedir(dir);
+}
 
-    bool found = true;
+// Stores `flags` in the cache.
+void store_cache(const std::string& directory, const std::string& path,
+                 const std::string& key, const FlagList& flags) {
+  CacheHeader header;
+  std::memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+  header.key_length = key.size();
+  header.file_count = flags.files.size();
+  header.name_count = flags.size();
+  header.names_length = flags.names.size();
+
+  std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+  data += key;
+  for (const auto& stamp : flags.files) {
+    CacheFile file{stamp.device, stamp.inode, stamp.size, stamp.mtime_ns,
+                   static_cast<uint32_t>(stamp.path.size())};
+    data.append(reinterpret_cast<const char*>(&file), sizeof(file));
+    data += stamp.path;
+  }
+  data.append(reinterpret_cast<const char*>(flags.offsets.data()),
+              flags.offsets.size() * 4);
+  data += flags.names;
+  if (data.size() > kMaxCacheEntrySize) return;
+
+  std::string temp_path = directory + "/.tmp-XXXXXX";
+  const int fd = mkstemp(&temp_path[0]);
+  if (fd == -1) return;
+
+  const bool ok = write(fd, data.data(), data.size()) ==
+                  static_cast<ssize_t>(data.size());
+  close(fd);
+
+  if (!ok || -1 == rename(temp_path.c_str(), path.c_str())) {
+    unlink(temp_path.c_str());
+    return;
+  }
 
-    if (executable.find('/') == std::string::npos) {
-      const char* path_str = getenv("PATH");
-      found = false;
+  trim_cache(directory);
+}
 
-      if (path_str) {
-        std::istringstream path(path_str);
+// Appends stamps of the files or directories at `paths` to `files`.  Paths
+// that don't exist get stamps with inode 0, which no file has.
+void add_stamps(const std::vector<std::string>& paths,
+                std::vector<FileStamp>& files) {
+  for (const auto& path : paths) {
+    struct stat st;
+    if (0 == stat(path.c_str(), &st))
+      files.emplace_back(make_stamp(path, st));
+    else
+      files.emplace_back(FileStamp{path, 0, 0, 0, 0});
+  }
+}
 
-        std::string path_element;
-        while (std::getline(path, path_element, ':')) {
-          if (path_element.back() != '/') path_element.push_back('/');
-          path_element += executable;
+// Finds `command` the way the shell would, and appends the directories it
+// searched to `directories`.  Returns an empty string if not found.
+std::string resolve_executable(const std::string& command,
+                               std::vector<std::string>& directories) {
+  if (command.find('/') != std::string::npos) return command;
 
-          if (0 == ::access(path_element.c_str(), F_OK)) {
-            found = true;
-            executable = std::move(path_element);
-            break;
-          }
+  const char* path_str = getenv("PATH");
+  if (!path_str) return std::string();
+
+  std::istringstream path(path_str);
+  std::string path_element;
+  while (std::getline(path, path_element, ':')) {
+    if (path_element.empty() || path_element.back() != '/')
+      path_element.push_back('/');
+    directories.emplace_back(path_element);
+    path_element += command;
+
+    if (0 == ::access(path_element.c_str(), F_OK)) return path_element;
+  }
+
+  return std::string();
+}
+
+// Reads the ELF file at `path`.  On failure, returns an exit status from
+// <sysexits.h> and sets `error`.
+int read_elf(const std::string& path, ElfFile& result, struct stat& st,
+             std::string& error) {
+  const auto fail = [&](int status, const std::string& message) {
+    error = message;
+    if (status != EX_DATAERR) (error += ": ") += std::strerror(errno);
+    return status;
+  };
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return fail(EX_NOINPUT, "Could not open '" + path + "' for reading");
+
+  if (-1 == fstat(fd, &st)) {
+    const auto status = fail(EX_IOERR, "Failed to stat '" + path + "'");
+    close(fd);
+    return status;
+  }
+
+  const ElfReader file(fd, st.st_size);
+  Elf32_Ehdr elf32;
+  Elf64_Ehdr elf64;
+  int status = 0;
+
+  if (!file.read(0, sizeof(elf32), &elf32) ||
+      0 != std::memcmp(elf32.e_ident, ELFMAG, SELFMAG)) {
+    status = fail(EX_DATAERR, "Not an ELF file");
+  } else {
+    result.elf_class = elf32.e_ident[EI_CLASS];
+
+    const auto corrupt = [&] {
+      return fail(EX_DATAERR, "'" + path + "' is corrupt or truncated");
+    };
+
+    switch (result.elf_class) {
+      case ELFCLASS32:
+        if (!parse_elf(file, elf32, result)) status = corrupt();
+        break;
+
+      case ELFCLASS64:
+        if (!file.read(0, sizeof(elf64), &elf64) ||
+            !parse_elf(file, elf64, result))
+          status = corrupt();
+        break;
+
+      default:
+        status = fail(EX_DATAERR, "Unrecognized ELF class " +
+                                      std::to_string(result.elf_class));
+    }
+  }
+
+  close(fd);
+  return status;
+}
+
+// Returns true if the file at `path` is an ELF file of the given class and
+// machine, i.e. a library the dynamic linker would accept.
+bool is_compatible_elf(const std::string& path, unsigned char elf_class,
+                       uint16_t machine) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  Elf32_Ehdr header;
+  const bool ok = sizeof(header) == read(fd, &header, sizeof(header)) &&
+                  0 == std::memcmp(header.e_ident, ELFMAG, SELFMAG) &&
+                  header.e_ident[EI_CLASS] == elf_class &&
+                  header.e_machine == machine;
+  close(fd);
+  return ok;
+}
+
+// Appends the colon separated directories in `list` to `result`.  "$ORIGIN"
+// is replaced with `origin`.
+void split_path_list(const std::string& list, const std::string& origin,
+                     std::vector<std::string>& result) {
+  std::istringstream input(list);
+  std::string directory;
+  while (std::getline(input, directory, ':')) {
+    if (directory.empty()) continue;
+    for (const char* variable : {"${ORIGIN}", "$ORIGIN"}) {
+      std::string::size_type i;
+      while (std::string::npos != (i = directory.find(variable)))
+        directory.replace(i, std::strlen(variable), origin);
+    }
+    result.emplace_back(std::move(directory));
+  }
+}
+
+// Reads the directories listed in ld.so.conf, following "include" lines.
+// The files read, and the directories searched for included files, are
+// appended to `sources`.
+void read_ld_so_conf(const char* path, std::vector<std::string>& result,
+                     std::vector<std::string>& sources, int depth = 0) {
+  if (depth > 8) return;
+
+  sources.emplace_back(path);
+  std::ifstream input(path);
+  std::string line;
+  while (std::getline(input, line)) {
+    line.erase(std::find(line.begin(), line.end(), '#'), line.end());
+
+    std::istringstream words(line);
+    std::string word;
+    if (!(words >> word)) continue;
+
+    if (word == "include") {
+      while (words >> word) {
+        const auto slash = word.rfind('/');
+        sources.emplace_back(slash == std::string::npos
+                                 ? "."
+                                 : word.substr(0, slash ? slash : 1));
+
+        glob_t matches;
+        if (0 == glob(word.c_str(), 0, nullptr, &matches)) {
+          for (size_t i = 0; i < matches.gl_pathc; ++i)
+            read_ld_so_conf(matches.gl_pathv[i], result, sources, depth + 1);
         }
+        globfree(&matches);
       }
+    } else {
+      do {
+        result.emplace_back(word);
+      } while (words >> word);
     }
+  }
+}
 
-    if (!found) return EXIT_FAILURE;
+// Finds shared libraries the way the dynamic linker does.
+class LibraryResolver {
+ public:
+  explicit LibraryResolver(const ElfFile& executable) {
+    if (const char* ld_library_path = getenv("LD_LIBRARY_PATH"))
+      split_path_list(ld_library_path, ".", ld_library_path_);
 
-    if (argc > 2)
-      filter = argv[2];
+    read_ld_so_conf("/etc/ld.so.conf", default_path_, config_files_);
+    for (const char* directory : {"/lib64", "/usr/lib64", "/lib", "/usr/lib"})
+      default_path_.emplace_back(directory);
 
-    if (argc > 3)
-      prev_argument = argv[3];
-  } else {
-    auto options = xflags::get_options();
-    options.emplace_back(option{nullptr, 0, nullptr, 0});
+    elf_class_ = executable.elf_class;
+    machine_ = executable.machine;
+  }
 
-    int i;
-    while (-1 != (i = getopt_long_only(argc, argv, "", options.data(), 0))) {
-      if (i == 0) break;
+  // Sets the DT_RPATH of the executable, which also applies to libraries
+  // without a DT_RUNPATH of their own.
+  void set_executable_rpath(const ElfFile& executable,
+                            const std::string& origin) {
+    if (executable.runpath.empty())
+      split_path_list(executable.rpath, origin, executable_rpath_);
+  }
 
-      if (i == '?')
-        errx(EX_USAGE, "Try '%s --help' for more information.", argv[0]);
+  // The files and directories ld.so.conf was read from.
+  const std::vector<std::string>& config_files() const { return config_files_; }
+
+  // Returns the path of the library `name` needed by `loader`, located in
+  // the directory `origin`, or an empty string if it's not found.  The
+  // directories searched are appended to `searched`.
+  std::string resolve(const std::string& name, const ElfFile& loader,
+                      const std::string& origin,
+                      std::vector<std::string>& searched) const {
+    if (name.find('/') != std::string::npos) return name;
+
+    std::vector<std::string> path;
+    if (loader.runpath.empty()) {
+      split_path_list(loader.rpath, origin, path);
+      path.insert(path.end(), executable_rpath_.begin(),
+                  executable_rpath_.end());
+    }
+    path.insert(path.end(), ld_library_path_.begin(), ld_library_path_.end());
+    split_path_list(loader.runpath, origin, path);
+    path.insert(path.end(), default_path_.begin(), default_path_.end());
+
+    for (const auto& directory : path) {
+      searched.emplace_back(directory);
+      auto candidate = directory + '/' + name;
+      if (is_compatible_elf(candidate, elf_class_, machine_)) return candidate;
+    }
+
+    return std::string();
+  }
+
+ private:
+  std::vector<std::string> executable_rpath_;
+  std::vector<std::string> ld_library_path_;
+  std::vector<std::string> default_path_;
+  std::vector<std::string> config_files_;
+  unsigned char elf_class_;
+  uint16_t machine_;
+};
+
+// Returns the directory containing `path`, after resolving symbolic links,
+// for use as $ORIGIN.
+std::string origin_of(const std::string& path) {
+  char resolved[PATH_MAX];
+  std::string result = realpath(path.c_str(), resolved) ? resolved : path;
+  const auto slash = result.rfind('/');
+  if (slash == std::string::npos) return ".";
+  result.erase(slash ? slash : 1);
+  return result;
+}
+
+// Reads the flags of all shared libraries `executable` depends on, directly
+// or indirectly.  Libraries are read concurrently, each by the first idle
+// thread, and queue their own dependencies as they are found.
+void read_library_flags(const ElfFile& executable, const std::string& origin,
+                        const struct stat& executable_st, std::string& names,
+                        std::vector<uint32_t>& offsets,
+                        std::vector<FileStamp>& files) {
+  LibraryResolver resolver(executable);
+  resolver.set_executable_rpath(executable, origin);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::string> queue;
+  std::set<std::pair<uint64_t, uint64_t>> seen;
+  std::set<std::string> searched;
+  size_t busy = 0;
+
+  seen.emplace(executable_st.st_dev, executable_st.st_ino);
+
+  // Queues the dependencies of `loader`.  Called with `mutex` held.
+  auto enqueue = [&](std::vector<std::string>& paths) {
+    for (auto& path : paths) {
+      struct stat st;
+      if (0 != stat(path.c_str(), &st)) continue;
+      if (!seen.emplace(st.st_dev, st.st_ino).second) continue;
+      queue.emplace_back(std::move(path));
+    }
+    cv.notify_all();
+  };
+
+  std::vector<std::string> paths, directories;
+  for (const auto& name : executable.needed) {
+    auto path = resolver.resolve(name, executable, origin, directories);
+    if (!path.empty()) paths.emplace_back(std::move(path));
+  }
+  searched.insert(directories.begin(), directories.end());
+  enqueue(paths);
+
+  auto worker = [&] {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for (;;) {
+      cv.wait(lock, [&] { return !queue.empty() || busy == 0; });
+      if (queue.empty()) return;
+
+      const auto path = std::move(queue.front());
+      queue.pop_front();
+      ++busy;
+      lock.unlock();
+
+      ElfFile library;
+      struct stat st;
+      std::string error;
+      std::vector<std::string> dependencies, directories;
+      const bool ok = 0 == read_elf(path, library, st, error);
+      if (ok) {
+        const auto library_origin = origin_of(path);
+        for (const auto& name : library.needed) {
+          auto dependency =
+              resolver.resolve(name, library, library_origin, directories);
+          if (!dependency.empty())
+            dependencies.emplace_back(std::move(dependency));
+        }
+      }
 
-      xflags::parse_flag(i, optarg);
+      lock.lock();
+      if (ok) {
+        const auto base = names.size();
+        names += library.names;
+        for (const auto offset : library.offsets)
+          offsets.emplace_back(base + offset);
+        files.emplace_back(make_stamp(path, st));
+      }
+      searched.insert(directories.begin(), directories.end());
+      --busy;
+      enqueue(dependencies);
     }
+  };
+
+  auto thread_count = std::thread::hardware_concurrency();
+  if (thread_count == 0) thread_count = 1;
+  if (thread_count > 8) thread_count = 8;
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < thread_count; ++i) threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads) thread.join();
+
+  // Adding a library to a directory searched before the one it was found in
+  // changes which library is loaded, as does changing ld.so.conf.
+  add_stamps(std::vector<std::string>(searched.begin(), searched.end()), files);
+  add_stamps(resolver.config_files(), files);
+}
+
+// Reads the flags of the executable at `path`, and those of its shared
+// libraries if requested.
+void read_flags(const std::string& path, FlagList& flags) {
+  ElfFile executable;
+  struct stat st;
+  std::string error;
+  if (const auto status = read_elf(path, executable, st, error))
+    errx(status, "%s", error.c_str());
+
+  flags.files.emplace_back(make_stamp(path, st));
+  flags.names = std::move(executable.names);
+  flags.offsets = std::move(executable.offsets);
+  bool sorted = executable.indexed;
+
+  if (libraries) {
+    const auto size = flags.offsets.size();
+    read_library_flags(executable, origin_of(path), st, flags.names,
+                       flags.offsets, flags.files);
+    sorted = sorted && size == flags.offsets.size();
+  }
+
+  if (!sorted) {
+    const char* names = flags.names.data();
+    auto& offsets = flags.offsets;
+    std::sort(offsets.begin(), offsets.end(), [names](uint32_t a, uint32_t b) {
+      return std::strcmp(names + a, names + b) < 0;
+    });
+    offsets.erase(std::unique(offsets.begin(), offsets.end(),
+                              [names](uint32_t a, uint32_t b) {
+                                return 0 == std::strcmp(names + a, names + b);
+                              }),
+                  offsets.end());
+  }
+}
+
+// Parses the options of xflags-complete itself.  In completion mode, parsing
+// stops at the first non-option, which is the command being completed, so
+// that the word being completed is never taken for an option.
+void parse_options(int argc, char** argv, bool completion_mode) {
+  auto options = xflags::get_options();
+  options.emplace_back(option{nullptr, 0, nullptr, 0});
+
+  int i;
+  while (-1 != (i = getopt_long_only(argc, argv, completion_mode ? "+" : "",
+                                     options.data(), 0))) {
+    if (i == 0) break;
+
+    if (i == '?')
+      errx(EX_USAGE, "Try '%s --help' for more information.", argv[0]);
+
+    xflags::parse_flag(i, optarg);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string command, filter;
+  std::string prev_argument;
+
+  if (getenv("COMP_LINE")) {
+    // Called by bash as `xflags-complete [OPTION]... COMMAND WORD PREVIOUS`.
+    parse_options(argc, argv, true);
+
+    command = getenv("COMP_LINE");
+
+    auto space = command.find(' ');
+    if (space != std::string::npos)
+      command.erase(space);
+
+    if (argc > optind + 1)
+      filter = argv[optind + 1];
+
+    if (argc > optind + 2)
+      prev_argument = argv[optind + 2];
+  } else {
+    parse_options(argc, argv, false);
 
     if (help) {
       std::cout << "Usage: " << argv[0] << " [OPTION]... ELF-PROGRAM\n\n"
@@ -155,6 +909,13 @@ int main(int argc, char** argv) {
                 << "\n"
                 << "  complete -C xflags-complete xflags-complete\n"
                 << "\n"
+                << "To include flags from shared libraries, use:\n"
+                << "\n"
+                << "  complete -C 'xflags-complete --libraries' COMMAND\n"
+                << "\n"
+                << "Results are cached in $XDG_CACHE_HOME/xflags-complete, or\n"
+                << "~/.cache/xflags-complete if XDG_CACHE_HOME is not set.\n"
+                << "\n"
                 << "Report bugs to: morten.hustveit@gmail.com\n";
 
       return EXIT_SUCCESS;
@@ -167,49 +928,82 @@ int main(int argc, char** argv) {
 
     if (optind + 1 != argc)
       errx(EX_USAGE, "Usage: %s [OPTION]... EXECUTABLE", argv[0]);
-    executable = argv[optind];
+    command = argv[optind];
   }
 
-  int fd = open(executable.c_str(), O_RDONLY);
-  if (fd == -1)
-    err(EX_NOINPUT, "Could not open '%s' for reading", executable.c_str());
-
-  off_t length = lseek(fd, 0, SEEK_END);
-  if (length == -1)
-    err(EX_IOERR, "Failed to seek to end of '%s'", executable.c_str());
+  // Everything that affects which files are read goes into the key.
+  std::string key = command;
+  if (command.find('/') == std::string::npos) {
+    key.push_back('\0');
+    if (const char* path = getenv("PATH")) key += path;
+  } else if (command[0] != '/') {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd))) {
+      key.push_back('\0');
+      key += cwd;
+    }
+  }
+  if (libraries) {
+    key.append("\0libraries", 10);
+    if (const char* path = getenv("LD_LIBRARY_PATH")) key += path;
+  }
 
-  void* map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
-  if (map == MAP_FAILED)
-    err(EX_IOERR, "Failed to memory-map '%s'", executable.c_str());
+  const std::string directory = cache ? cache_directory() : std::string();
+  const std::string entry_path =
+      directory.empty() ? std::string() : cache_path(directory, key);
 
-  auto elf32 = reinterpret_cast<const Elf32_Ehdr*>(map);
-  if (0 != std::memcmp(elf32->e_ident, ELFMAG, SELFMAG))
-    errx(EX_DATAERR, "Not an ELF file");
+  FlagList flags;
+  if (entry_path.empty() || !load_cache(entry_path, key, flags)) {
+    flags = FlagList();
 
-  std::vector<std::string> arguments;
+    std::vector<std::string> directories;
+    const auto executable = resolve_executable(command, directories);
+    if (executable.empty()) return EXIT_FAILURE;
 
-  switch (elf32->e_ident[EI_CLASS]) {
-    case ELFCLASS32:
-      arguments = parse_elf(elf32);
-      break;
+    read_flags(executable, flags);
 
-    case ELFCLASS64:
-      arguments = parse_elf(reinterpret_cast<const Elf64_Ehdr*>(map));
-      break;
+    // Adding the command to a directory searched before the one it was found
+    // in changes that directory's modification time, or creates it.
+    add_stamps(directories, flags.files);
 
-    default:
-      errx(EX_DATAERR, "Unrecognized ELF class %d", elf32->e_ident[EI_CLASS]);
+    if (!entry_path.empty()) store_cache(directory, entry_path, key, flags);
   }
 
-  if (arguments.size() == 1 && prev_argument == arguments[0]) return EXIT_SUCCESS;
-
-  std::sort(arguments.begin(), arguments.end());
-
-  for (auto&& argument : arguments) {
-    if (argument.size() < filter.size() ||
-        0 != argument.compare(0, filter.size(), filter))
-      continue;
+  if (flags.size() == 1 && 0 == prev_argument.compare(0, 2, "--") &&
+      0 == prev_argument.compare(2, std::string::npos, flags[0]))
+    return EXIT_SUCCESS;
+
+  // Flags are completed as "--NAME", so only "", "-" and words starting with
+  // "--" match any.
+  const char* prefix;
+  if (0 == filter.compare(0, 2, "--"))
+    prefix = filter.c_str() + 2;
+  else if (filter.empty() || filter == "-")
+    prefix = "";
+  else
+    return EXIT_SUCCESS;
+  const size_t prefix_length = std::strlen(prefix);
+
+  // The flags are sorted, so the matches form a contiguous range.
+  auto match = std::lower_bound(
+      flags.offsets.begin(), flags.offsets.end(), prefix,
+      [&flags](uint32_t offset, const char* value) {
+        return std::strcmp(flags.names.data() + offset, value) < 0;
+      });
+
+  // The matches are written with a single write(2).
+  std::string output;
+  for (; match != flags.offsets.end(); ++match) {
+    const char* name = flags.names.data() + *match;
+    if (0 != std::strncmp(name, prefix, prefix_length)) break;
+    ((output += "--") += name) += '\n';
+  }
 
-    std::cout << argument << '\n';
+  const char* const output_end = output.data() + output.size();
+  for (const char* ptr = output.data(); ptr != output_end;) {
+    const auto ret = write(STDOUT_FILENO, ptr, output_end - ptr);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret <= 0) err(EX_IOERR, "write failed");
+    ptr += ret;
   }
 }
@@ -0,0 +1,45 @@
+// Support for `protect_data`.  This is separate from xflags.cc so that only
+// programs calling it link the padding below; the others get the cache line
+// alignment from xflags.cc.
+
+#include "xflags.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+
+// Bounds of the `xflags_data` section, defined by the linker.
+extern "C" {
+extern char __start_xflags_data[] __attribute__((weak, visibility("hidden")));
+extern char __stop_xflags_data[] __attribute__((weak, visibility("hidden")));
+}
+
+namespace {
+
+// Aligns the section to a page, so that flags are packed from the start of a
+// page and cache line.  The library is normally linked after the objects
+// defining flags, which places this page at the end of the section, so that
+// `protect_data` can protect the last page holding flags as well.  (Link
+// time optimization may reorder it, leaving that page writable.)
+alignas(4096) char padding[4096] XFLAGS_DATA __attribute__((used));
+
+}  // namespace
+
+namespace xflags {
+
+bool protect_data() {
+  const auto page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const auto begin = reinterpret_cast<uintptr_t>(__start_xflags_data);
+  const auto end = reinterpret_cast<uintptr_t>(__stop_xflags_data);
+
+  // Pages shared with other sections must stay writable.
+  const auto first_page = (begin + page_size - 1) & ~(page_size - 1);
+  const auto last_page = end & ~(page_size - 1);
+  if (first_page >= last_page) return true;
+
+  return 0 == mprotect(reinterpret_cast<void*>(first_page),
+                       last_page - first_page, PROT_READ);
+}
+
+}  // namespace xflags
@@ -0,0 +1,284 @@
+// Adds a sorted index of the exported flag names to ELF programs, which
+// xflags-complete uses instead of sorting the names itself.  See
+// xflags-index.h for the format.
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <elf.h>
+#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "xflags-index.h"
+#include "xflags.h"
+
+namespace {
+
+// Print help and exit.
+bool help;
+
+// Print version information and exit.
+bool version;
+
+// The objcopy program used to add the index.
+std::string objcopy = "objcopy";
+
+}  // namespace
+
+XFLAGS_EXPORT(help, nullptr, "print this help and exit");
+XFLAGS_EXPORT(version, nullptr, "print version information and exit");
+XFLAGS_EXPORT(objcopy, "PROGRAM",
+              "use PROGRAM to modify ELF files (default: objcopy)");
+
+template <typename ElfType>
+struct ElfClasses {};
+
+template <>
+struct ElfClasses<Elf32_Ehdr> {
+  using Section = Elf32_Shdr;
+};
+
+template <>
+struct ElfClasses<Elf64_Ehdr> {
+  using Section = Elf64_Shdr;
+};
+
+// Returns true if `size` bytes at `offset` lie within `length` bytes.
+bool in_bounds(uint64_t offset, uint64_t size, size_t length) {
+  return offset <= length && size <= length - offset;
+}
+
+// Builds the index of the `.xflags-names` section of `data`, which is
+// `length` bytes long.  Returns false if there is no such section.
+template <typename ElfType>
+bool build_index(const ElfType* data, size_t length, std::string& result) {
+  using Section = typename ElfClasses<ElfType>::Section;
+
+  auto base = reinterpret_cast<const char*>(data);
+
+  // Files without section headers, like some stripped programs, export no
+  // flags we can find.
+  if (data->e_shoff == 0) return false;
+  if (data->e_shentsize < sizeof(Section))
+    errx(EX_DATAERR, "Corrupt section header size");
+
+  auto section_at = [&](uint64_t i) {
+    const uint64_t offset = data->e_shoff + i * data->e_shentsize;
+    if (!in_bounds(offset, sizeof(Section), length))
+      errx(EX_DATAERR, "Section header %llu is out of bounds",
+           static_cast<unsigned long long>(i));
+    return reinterpret_cast<const Section*>(base + offset);
+  };
+
+  uint64_t section_count, strings_index;
+  xflags_section_counts(*data, *section_at(0), section_count, strings_index);
+  if (section_count > length / data->e_shentsize ||
+      strings_index >= section_count)
+    errx(EX_DATAERR, "Corrupt section count");
+
+  // Section names are compared with strcmp, so the table must end with a NUL.
+  auto string_table = section_at(strings_index);
+  if (string_table->sh_type != SHT_STRTAB || string_table->sh_size == 0 ||
+      !in_bounds(string_table->sh_offset, string_table->sh_size, length))
+    errx(EX_DATAERR, "Corrupt string table");
+  auto strings = base + string_table->sh_offset;
+  if (strings[string_table->sh_size - 1] != '\0')
+    errx(EX_DATAERR, "String table is not NUL-terminated");
+
+  for (uint64_t i = 0; i < section_count; ++i) {
+    auto section = section_at(i);
+    if (section->sh_name >= string_table->sh_size ||
+        0 != std::strcmp(strings + section->sh_name, ".xflags-names"))
+      continue;
+
+    if (!in_bounds(section->sh_offset, section->sh_size, length))
+      errx(EX_DATAERR, "Section .xflags-names is out of bounds");
+
+    const char* names = base + section->sh_offset;
+    const size_t names_size = section->sh_size;
+    if (names_size && names[names_size - 1] != '\0')
+      errx(EX_DATAERR, "Section .xflags-names is not NUL-terminated");
+
+    std::vector<uint32_t> offsets;
+    for (size_t offset = 0; offset < names_size;) {
+      const size_t name_length = std::strlen(names + offset);
+      if (name_length) offsets.emplace_back(offset);
+      offset += name_length + 1;
+    }
+
+    auto less = [names](uint32_t lhs, uint32_t rhs) {
+      return std::strcmp(names + lhs, names + rhs) < 0;
+    };
+    auto equal = [names](uint32_t lhs, uint32_t rhs) {
+      return 0 == std::strcmp(names + lhs, names + rhs);
+    };
+    std::sort(offsets.begin(), offsets.end(), less);
+    offsets.erase(std::unique(offsets.begin(), offsets.end(), equal),
+                  offsets.end());
+
+    XflagsIndexHeader header;
+    std::memcpy(header.magic, kXflagsIndexMagic, sizeof(header.magic));
+    header.count = offsets.size();
+    header.names_size = names_size;
+    header.names_hash = xflags_index_hash(names, names_size);
+
+    result.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+    result.append(reinterpret_cast<const char*>(offsets.data()),
+                  offsets.size() * sizeof(offsets[0]));
+    return true;
+  }
+
+  return false;
+}
+
+namespace {
+
+// Reads the ELF file at `path` and builds its index.  Returns false if the
+// file exports no flags.
+bool read_index(const char* path, std::string& result) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) err(EX_NOINPUT, "Could not open '%s' for reading", path);
+
+  struct stat st;
+  if (-1 == fstat(fd, &st)) err(EX_IOERR, "Failed to stat '%s'", path);
+
+  const size_t length = st.st_size;
+  if (length < sizeof(Elf32_Ehdr))
+    errx(EX_DATAERR, "%s: Not an ELF file", path);
+
+  void* map = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) err(EX_IOERR, "Failed to memory-map '%s'", path);
+  close(fd);
+
+  auto elf32 = reinterpret_cast<const Elf32_Ehdr*>(map);
+  if (0 != std::memcmp(elf32->e_ident, ELFMAG, SELFMAG))
+    errx(EX_DATAERR, "%s: Not an ELF file", path);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  const unsigned char host_data = ELFDATA2LSB;
+#else
+  const unsigned char host_data = ELFDATA2MSB;
+#endif
+  if (elf32->e_ident[EI_DATA] != host_data)
+    errx(EX_DATAERR, "%s: Byte order differs from that of this host", path);
+
+  bool found = false;
+
+  switch (elf32->e_ident[EI_CLASS]) {
+    case ELFCLASS32:
+      found = build_index(elf32, length, result);
+      break;
+
+    case ELFCLASS64:
+      if (length < sizeof(Elf64_Ehdr))
+        errx(EX_DATAERR, "%s: Not an ELF file", path);
+      found = build_index(reinterpret_cast<const Elf64_Ehdr*>(map), length,
+                          result);
+      break;
+
+    default:
+      errx(EX_DATAERR, "%s: Unrecognized ELF class %d", path,
+           elf32->e_ident[EI_CLASS]);
+  }
+
+  munmap(map, length);
+  return found;
+}
+
+// Replaces the index section of `path` with the contents of `index_path`.
+// Returns false on failure.
+bool add_index(const char* path, const std::string& index_path) {
+  const std::string section = XFLAGS_INDEX_SECTION;
+  const std::string remove = "--remove-section=" + section;
+  const std::string contents = section + "=" + index_path;
+  const std::string section_flags = section + "=readonly";
+
+  const char* argv[] = {objcopy.c_str(),      remove.c_str(),
+                        "--add-section",      contents.c_str(),
+                        "--set-section-flags", section_flags.c_str(),
+                        path,                 nullptr};
+
+  const pid_t pid = fork();
+  if (pid == -1) err(EX_OSERR, "fork failed");
+
+  if (pid == 0) {
+    execvp(argv[0], const_cast<char* const*>(argv));
+    warn("Failed to execute '%s'", argv[0]);
+    _exit(EX_UNAVAILABLE);
+  }
+
+  int status;
+  if (-1 == waitpid(pid, &status, 0)) err(EX_OSERR, "waitpid failed");
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    warnx("%s: '%s' failed", path, argv[0]);
+    return false;
+  }
+
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  xflags::parse(argc, argv);
+
+  if (help) {
+    std::cout << "Usage: " << argv[0] << " [OPTION]... ELF-PROGRAM...\n\n"
+              << "Adds a sorted index of the flags exported by each ELF-PROGRAM, for use\n"
+              << "by xflags-complete.  Run it again whenever a program is relinked.\n"
+              << "\n";
+    xflags::print_help();
+    std::cout << "\n"
+              << "Report bugs to: morten.hustveit@gmail.com\n";
+
+    return EXIT_SUCCESS;
+  }
+
+  if (version) {
+    std::cout << PACKAGE_STRING << '\n';
+    return EXIT_SUCCESS;
+  }
+
+  if (optind == argc)
+    errx(EX_USAGE, "Usage: %s [OPTION]... ELF-PROGRAM...", argv[0]);
+
+  int result = EXIT_SUCCESS;
+
+  for (int i = optind; i < argc; ++i) {
+    std::string index;
+    if (!read_index(argv[i], index)) {
+      warnx("%s: No flags to index", argv[i]);
+      continue;
+    }
+
+    const char* temp_directory = getenv("TMPDIR");
+    std::string index_path = temp_directory ? temp_directory : "/tmp";
+    index_path += "/xflags-index-XXXXXX";
+    const int index_fd = mkstemp(&index_path[0]);
+    if (index_fd == -1) err(EX_CANTCREAT, "Failed to create temporary file");
+
+    const bool ok = write(index_fd, index.data(), index.size()) ==
+                    static_cast<ssize_t>(index.size());
+    close(index_fd);
+
+    if (!ok) {
+      warn("Failed to write '%s'", index_path.c_str());
+      result = EX_IOERR;
+    } else if (!add_index(argv[i], index_path)) {
+      result = EX_SOFTWARE;
+    }
+
+    unlink(index_path.c_str());
+  }
+
+  return result;
+}
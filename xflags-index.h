@@ -0,0 +1,91 @@
+#ifndef XFLAGS_INDEX_H_
+#define XFLAGS_INDEX_H_ 1
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <elf.h>
+
+// Layout of the `.xflags-index` section added to programs by xflags-index.
+//
+// The section holds an `XflagsIndexHeader`, followed by `count` offsets of
+// flag names in `.xflags-names`, sorted by name, without duplicates.  All
+// fields use the byte order of the host that wrote the index, which must
+// match that of the ELF file.
+//
+// `names_size` and `names_hash` describe the `.xflags-names` section the
+// index was built from.  Readers must ignore indexes that don't match, e.g.
+// after the program was relinked without running xflags-index again.
+
+#define XFLAGS_INDEX_SECTION ".xflags-index"
+
+const char kXflagsIndexMagic[8] = {'X', 'F', 'L', 'G', 'I', 'D', 'X', '1'};
+
+struct XflagsIndexHeader {
+  char magic[8];
+  uint32_t count;
+  uint32_t names_size;
+  uint64_t names_hash;
+};
+
+// Returns the FNV-1a hash of `size` bytes at `data`.
+inline uint64_t xflags_index_hash(const char* data, size_t size) {
+  uint64_t hash = UINT64_C(14695981039346656037);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= UINT64_C(1099511628211);
+  }
+  return hash;
+}
+
+// Sets `section_count` and `strings_index` to the number of sections and the
+// index of the section name string table of the ELF file with the header
+// `header`.  With many sections, the real values are stored in the first
+// section header, `first`, which is only used in that case.
+template <typename ElfType, typename Section>
+inline void xflags_section_counts(const ElfType& header, const Section& first,
+                                  uint64_t& section_count,
+                                  uint64_t& strings_index) {
+  section_count = header.e_shnum;
+  strings_index = header.e_shstrndx;
+  if (section_count == 0) section_count = first.sh_size;
+  if (strings_index == SHN_XINDEX) strings_index = first.sh_link;
+}
+
+// Returns the `i`th offset of an index whose offsets start at `offsets`.
+// Sections added after linking need not be aligned, so offsets are read
+// with memcpy.
+inline uint32_t xflags_index_offset(const char* offsets, size_t i) {
+  uint32_t result;
+  std::memcpy(&result, offsets + i * sizeof(result), sizeof(result));
+  return result;
+}
+
+// Returns a pointer to the offsets in the index `index` of `index_size`
+// bytes, if it's valid for the `.xflags-names` section `names` of
+// `names_size` bytes, and sets `count`.  Otherwise returns nullptr.
+inline const char* xflags_index_offsets(const char* index, size_t index_size,
+                                        const char* names, size_t names_size,
+                                        uint32_t& count) {
+  XflagsIndexHeader header;
+  if (index_size < sizeof(header)) return nullptr;
+  std::memcpy(&header, index, sizeof(header));
+
+  if (0 != std::memcmp(header.magic, kXflagsIndexMagic, sizeof(header.magic)) ||
+      header.names_size != names_size ||
+      index_size - sizeof(header) != uint64_t(header.count) * 4 ||
+      header.names_hash != xflags_index_hash(names, names_size))
+    return nullptr;
+
+  const char* offsets = index + sizeof(header);
+  for (uint32_t i = 0; i < header.count; ++i) {
+    if (xflags_index_offset(offsets, i) >= names_size) return nullptr;
+  }
+  if (names_size && names[names_size - 1] != '\0') return nullptr;
+
+  count = header.count;
+  return offsets;
+}
+
+#endif  // !XFLAGS_INDEX_H_
@@ -0,0 +1,11 @@
+// A plugin loaded with dlopen(3) by xflags-test.
+
+#include <cstdint>
+
+#include "xflags.h"
+
+extern "C" {
+int32_t test_plugin_int;
+}
+
+XFLAGS_EXPORT(test_plugin_int, "N", "an integer exported by a plugin");
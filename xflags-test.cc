@@ -0,0 +1,694 @@
+// Checks run by `make check`.  Each check exits with a message on failure.
+
+#include <cerrno>
+#include <clocale>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <dlfcn.h>
+#include <err.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "xflags.h"
+
+namespace {
+
+size_t allocation_count;
+
+}  // namespace
+
+void* operator new(size_t size) {
+  ++allocation_count;
+  if (void* result = std::malloc(size ? size : 1)) return result;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+int32_t test_int;
+double test_double;
+bool test_bool;
+std::string test_string;
+
+XFLAGS_EXPORT(test_int, "N", "an integer");
+XFLAGS_EXPORT(test_double, "X", "a floating point number");
+XFLAGS_EXPORT(test_bool, nullptr, "a boolean");
+XFLAGS_EXPORT(test_string, "STRING", "a short string");
+
+// More flags than `FlagValues` searches linearly.
+#define TEST_FILLER(n) \
+  int32_t test_filler_##n; \
+  XFLAGS_EXPORT(test_filler_##n, "N", "a flag for filling FlagValues")
+
+TEST_FILLER(0);
+TEST_FILLER(1);
+TEST_FILLER(2);
+TEST_FILLER(3);
+TEST_FILLER(4);
+TEST_FILLER(5);
+TEST_FILLER(6);
+TEST_FILLER(7);
+TEST_FILLER(8);
+TEST_FILLER(9);
+TEST_FILLER(10);
+TEST_FILLER(11);
+TEST_FILLER(12);
+TEST_FILLER(13);
+TEST_FILLER(14);
+TEST_FILLER(15);
+TEST_FILLER(16);
+
+const int kFillerCount = 17;
+
+std::vector<int32_t> test_list;
+std::vector<std::string> test_names;
+
+XFLAGS_EXPORT(test_list, "N,...", "a list of integers");
+XFLAGS_EXPORT(test_names, "NAME,...", "a list of strings");
+
+xflags::Shared<std::vector<uint64_t>> shared_ids;
+XFLAGS_EXPORT(shared_ids, "ID,...", "a list of IDs shared between processes");
+
+namespace {
+
+// parse() must not allocate memory for scalar flags, not even on the first
+// call, which builds the flag index.
+void check_parse_allocations() {
+  for (int i = 0; i < 2; ++i) {
+    char arg0[] = "", arg1[] = "--test_int=42", arg2[] = "--test_double=0.5",
+         arg3[] = "--test_bool", arg4[] = "--test_string=short";
+    char* argv[] = {arg0, arg1, arg2, arg3, arg4, nullptr};
+
+    const auto allocations_before = allocation_count;
+    xflags::parse(5, argv);
+    if (allocation_count != allocations_before)
+      errx(EXIT_FAILURE, "parse() allocated memory for scalar flags");
+  }
+
+  if (test_int != 42 || test_double != 0.5 || !test_bool ||
+      test_string != "short")
+    errx(EXIT_FAILURE, "parse() set wrong values");
+}
+
+// Parses `string` like the integer parsers did when they called `strtoll`.
+template <typename T>
+typename std::enable_if<std::numeric_limits<T>::is_signed, bool>::type
+reference_parse(const char* string, T& value, const char** endptr) {
+  errno = 0;
+  const auto result = std::strtoll(string, const_cast<char**>(endptr), 0);
+  if (errno != 0 || result > std::numeric_limits<T>::max() ||
+      result < std::numeric_limits<T>::min() || *endptr == string)
+    return false;
+  value = result;
+  return true;
+}
+
+// Parses `string` like the integer parsers did when they called `strtoull`.
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value &&
+                            !std::numeric_limits<T>::is_signed,
+                        bool>::type
+reference_parse(const char* string, T& value, const char** endptr) {
+  errno = 0;
+  const auto result = std::strtoull(string, const_cast<char**>(endptr), 0);
+  if (errno != 0 || result > std::numeric_limits<T>::max() ||
+      *endptr == string)
+    return false;
+  value = result;
+  return true;
+}
+
+// Returns the "C" locale, which floating point numbers are parsed in.
+locale_t c_locale() {
+  static const locale_t locale = newlocale(LC_ALL_MASK, "C", nullptr);
+  return locale;
+}
+
+// Parses `string` like the float parser did when it called `strtof`.
+bool reference_parse(const char* string, float& value, const char** endptr) {
+  errno = 0;
+  value = strtof_l(string, const_cast<char**>(endptr), c_locale());
+  return errno == 0 && *endptr != string;
+}
+
+// Parses `string` like the double parser did when it called `strtod`.
+bool reference_parse(const char* string, double& value, const char** endptr) {
+  errno = 0;
+  value = strtod_l(string, const_cast<char**>(endptr), c_locale());
+  return errno == 0 && *endptr != string;
+}
+
+// Checks that `Parser<T>` accepts `string` if and only if the reference
+// does, with the same value and end pointer.
+template <typename T>
+void check_number(const char* string, const char* type) {
+  T value = 0, expected_value = 0;
+  const char* endptr = nullptr;
+  const char* expected_endptr = nullptr;
+  const bool ok = xflags::Parser<T>::parse(&value, string, &endptr);
+  const bool expected_ok = reference_parse(string, expected_value,
+                                           &expected_endptr);
+
+  if (ok != expected_ok || endptr != expected_endptr ||
+      (ok && 0 != std::memcmp(&value, &expected_value, sizeof(value))))
+    errx(EXIT_FAILURE, "Parsing \"%s\" as %s differs from libc", string,
+         type);
+}
+
+void check_number(const char* string) {
+  check_number<int8_t>(string, "int8_t");
+  check_number<uint8_t>(string, "uint8_t");
+  check_number<int16_t>(string, "int16_t");
+  check_number<uint16_t>(string, "uint16_t");
+  check_number<int32_t>(string, "int32_t");
+  check_number<uint32_t>(string, "uint32_t");
+  check_number<int64_t>(string, "int64_t");
+  check_number<uint64_t>(string, "uint64_t");
+  check_number<float>(string, "float");
+  check_number<double>(string, "double");
+}
+
+// Returns a random string that looks more or less like a number.
+std::string random_number(std::mt19937_64& random) {
+  static const char* const kPieces[] = {
+      "",   "",   " ",  "-",  "+",  "0",  "0x", "0X", ".",  "e",  "E", "e-",
+      "e+", "1",  "9",  "7",  "a",  "f",  "g",  "p",  "p-", ",",  "x", "inf",
+      "nan", "infinity", "123456789", "0000", "99999999",
+  };
+  const size_t piece_count = sizeof(kPieces) / sizeof(kPieces[0]);
+
+  std::string result;
+  for (auto n = random() % 8; n-- > 0;) {
+    // Mostly digits, so that long mantissas are common.
+    if (random() % 2) {
+      for (auto digits = random() % 12; digits-- > 0;)
+        result.push_back('0' + random() % 10);
+    } else {
+      result += kPieces[random() % piece_count];
+    }
+  }
+  return result;
+}
+
+// The hand-written integer and floating point parsers must agree with libc.
+void check_numbers() {
+  static const char* const kNumbers[] = {
+      "", "0", "-0", "+0", "+1", "+", "-", " 42", "\t-7", "\n1", "1 ", "0x",
+      "0x1g", "0X1F", "-0x10", "010", "08", "0x8000000000000000",
+      "127", "128", "-128", "-129", "255", "256", "32767", "32768", "-32769",
+      "65535", "65536", "2147483647", "2147483648", "-2147483647",
+      "-2147483648", "-2147483649", "4294967295", "4294967296",
+      "9223372036854775807", "9223372036854775808", "-9223372036854775807",
+      "-9223372036854775808", "-9223372036854775809",
+      "18446744073709551615", "18446744073709551616", "-18446744073709551615",
+      "-18446744073709551616", "0xffffffffffffffff", "0x10000000000000000",
+      "99999999999999999999999", "1234567890123456789",
+      "12345678901234567890", "123456789012345678901", "123abc", "12345678x",
+      "1.5", "1.5x", "1,5", ".5", "5.", ".", "-.5e1", "1e", "1e+", "1e-5x",
+      "1e22", "1e23", "1e-22", "1e-23", "9007199254740992",
+      "9007199254740993", "123456789012345678e-5", "1234567890123456789e3",
+      "12345678901234567890e-3", "0.1234567890123456789",
+      "0.12345678901234567890", "00000000000000000000001",
+      "0.000000000000000000000000000001", "3.4028235e38", "3.4028236e38",
+      "1e-38", "1e-45", "1e-46", "1.7976931348623157e308", "1e309",
+      "-1e309", "2.2250738585072014e-308", "2.2250738585072009e-308",
+      "4.9e-324", "1e-310", "1e-400", "1e99999999999", "0e99999999999",
+      "0x1p-3", "0x1.8p1", "inf", "-inf", "INF", "infinity", "infinit",
+      "nan", "-nan", "NAN", "nan(123)", "nanx",
+  };
+  for (const char* string : kNumbers) check_number(string);
+
+  std::mt19937_64 random(1);
+  for (int i = 0; i < 100000; ++i) check_number(random_number(random).c_str());
+
+  // Numbers don't depend on the locale, so a decimal comma is never used.
+  for (const char* locale : {"de_DE.UTF-8", "fr_FR.UTF-8", "de_DE", "fr_FR"}) {
+    if (!std::setlocale(LC_NUMERIC, locale)) continue;
+    for (const char* string : kNumbers) check_number(string);
+    double value;
+    const char* endptr;
+    if (!xflags::Parser<double>::parse(&value, "1.5", &endptr) ||
+        value != 1.5 || *endptr != '\0')
+      errx(EXIT_FAILURE, "Parsing numbers depends on LC_NUMERIC=%s", locale);
+    std::setlocale(LC_NUMERIC, "C");
+    break;
+  }
+}
+
+// The values of the flags set by `check_command_lines`.
+struct CommandLineValues {
+  int32_t test_int = 0;
+  double test_double = 0;
+  bool test_bool = false;
+  std::string test_string;
+  int32_t test_filler_1 = 0;
+  int32_t test_filler_10 = 0;
+
+  bool operator==(const CommandLineValues& other) const {
+    return test_int == other.test_int && test_double == other.test_double &&
+           test_bool == other.test_bool && test_string == other.test_string &&
+           test_filler_1 == other.test_filler_1 &&
+           test_filler_10 == other.test_filler_10;
+  }
+};
+
+// Sets the flags to `values`.
+void set_values(const CommandLineValues& values) {
+  test_int = values.test_int;
+  test_double = values.test_double;
+  test_bool = values.test_bool;
+  test_string = values.test_string;
+  test_filler_1 = values.test_filler_1;
+  test_filler_10 = values.test_filler_10;
+}
+
+CommandLineValues get_values() {
+  CommandLineValues result;
+  result.test_int = test_int;
+  result.test_double = test_double;
+  result.test_bool = test_bool;
+  result.test_string = test_string;
+  result.test_filler_1 = test_filler_1;
+  result.test_filler_10 = test_filler_10;
+  return result;
+}
+
+// Returns `args` as one string, for error messages.
+std::string join(const std::vector<std::string>& args) {
+  std::string result;
+  for (const auto& arg : args) result += " '" + arg + "'";
+  return result;
+}
+
+// Parses `args` with `getopt_long_only`, which `parse` replaces.  Returns
+// the arguments in the order `getopt_long_only` left them, and sets
+// `first_argument` to its final `optind`.
+std::vector<std::string> getopt_parse(const std::vector<std::string>& args,
+                                      int& first_argument) {
+  std::vector<std::string> strings = args;
+  std::vector<char*> argv;
+  for (auto& arg : strings) argv.emplace_back(&arg[0]);
+  argv.emplace_back(nullptr);
+
+  auto options = xflags::get_options();
+  options.emplace_back(option{nullptr, 0, nullptr, 0});
+
+  optind = 0;
+  int val;
+  while (-1 != (val = getopt_long_only(args.size(), argv.data(), "",
+                                       options.data(), nullptr))) {
+    if (val == '?') errx(EXIT_FAILURE, "getopt rejected%s", join(args).c_str());
+    xflags::parse_flag(val, optarg);
+  }
+  first_argument = optind;
+
+  return std::vector<std::string>(argv.begin(), argv.end() - 1);
+}
+
+// Parses `args` with `parse`, like `getopt_parse`.
+std::vector<std::string> xflags_parse(const std::vector<std::string>& args,
+                                      int& first_argument) {
+  std::vector<std::string> strings = args;
+  std::vector<char*> argv;
+  for (auto& arg : strings) argv.emplace_back(&arg[0]);
+  argv.emplace_back(nullptr);
+
+  xflags::parse(args.size(), argv.data());
+  first_argument = optind;
+
+  return std::vector<std::string>(argv.begin(), argv.end() - 1);
+}
+
+// `parse` finds flags through a hash table and moves options in front of
+// other arguments itself.  Both must give the same results as
+// `getopt_long_only`, including for flags that are prefixes of others.
+void check_command_lines() {
+  static const std::vector<std::vector<std::string>> kGroups{
+      {"--test_int=1"},      {"-test_int", "2"},   {"--test_int", "-3"},
+      {"-test_i=4"},         {"--test_bool"},      {"-test_bool=false"},
+      {"--test_bool=true"},  {"--test_double=.5"}, {"-test_do", "1e3"},
+      {"--test_string="},    {"--test_st", "-"},   {"-test_string=a=b"},
+      {"--test_filler_1=5"}, {"-test_filler_1", "6"},
+      {"-test_filler_10=7"}, {"--test_filler_10", "8"},
+      {"x"},                 {"-"},                {"--"},
+  };
+
+  std::mt19937_64 random(1);
+  for (int i = 0; i < 20000; ++i) {
+    std::vector<std::string> args{"test"};
+    for (auto n = random() % 8; n-- > 0;) {
+      const auto& group = kGroups[random() % kGroups.size()];
+      args.insert(args.end(), group.begin(), group.end());
+    }
+
+    set_values(CommandLineValues());
+    int expected_first;
+    const auto expected_argv = getopt_parse(args, expected_first);
+    const auto expected_values = get_values();
+
+    set_values(CommandLineValues());
+    int first;
+    const auto argv = xflags_parse(args, first);
+
+    if (argv != expected_argv || first != expected_first ||
+        !(get_values() == expected_values))
+      errx(EXIT_FAILURE, "parse() differs from getopt_long_only for%s",
+           join(args).c_str());
+  }
+}
+
+// Ambiguous prefixes are reported with the dashes they were given with, like
+// `getopt_long_only` does.
+void check_ambiguous_options() {
+  const xflags::FlagSet flag_set;
+  for (const std::string prefix : {"-", "--"}) {
+    const auto arg = prefix + "test_filler_";
+    const char* argv[] = {"", arg.c_str()};
+    xflags::FlagValues values;
+    std::string error;
+    if (flag_set.parse(2, argv, values, error) ||
+        error.find(" '" + prefix + "test_filler_10'") == std::string::npos ||
+        (prefix == "-" && error.find("'--") != std::string::npos))
+      errx(EXIT_FAILURE, "Wrong error for %s: %s", arg.c_str(), error.c_str());
+  }
+}
+
+// Errors reported through `error_handler` while it's `record_error`.
+std::vector<std::string> errors;
+
+void record_error(int, const char* fmt, ...) {
+  char buffer[1024];
+  va_list args;
+  va_start(args, fmt);
+  std::vsnprintf(buffer, sizeof(buffer), fmt, args);
+  va_end(args);
+  errors.emplace_back(buffer);
+}
+
+void write_file(const std::string& path, const std::string& contents) {
+  std::ofstream output(path);
+  output << contents;
+  if (!output.flush()) errx(EXIT_FAILURE, "Could not write '%s'", path.c_str());
+}
+
+// Parses `args`, and checks that `errors` are reported, each containing the
+// given string, and that `expected` are the resulting values.
+void check_flagfile(const std::vector<std::string>& args,
+                    const CommandLineValues& expected,
+                    const std::vector<std::string>& expected_errors = {}) {
+  set_values(CommandLineValues());
+  errors.clear();
+  int first;
+  xflags_parse(args, first);
+
+  bool ok = get_values() == expected && errors.size() == expected_errors.size();
+  for (size_t i = 0; ok && i < errors.size(); ++i)
+    ok = errors[i].find(expected_errors[i]) != std::string::npos;
+  if (!ok)
+    errx(EXIT_FAILURE, "Wrong result for%s%s", join(args).c_str(),
+         errors.empty() ? "" : (": " + errors.front()).c_str());
+}
+
+// Flag files are mapped and parsed in place rather than read through stdio,
+// which must not change how they're read.
+void check_flagfiles() {
+  char directory_template[] = "/tmp/xflags-test.XXXXXX";
+  const char* directory = mkdtemp(directory_template);
+  if (!directory) err(EXIT_FAILURE, "mkdtemp");
+  const std::string dir = directory;
+  const auto main_path = dir + "/main.flags";
+  const auto included_path = dir + "/included.flags";
+  const auto self_path = dir + "/self.flags";
+  const auto page_path = dir + "/page.flags";
+  const auto empty_path = dir + "/empty.flags";
+
+  // Comments, blank lines, optional dashes, white space around lines and
+  // '=' in values, and no newline at the end.
+  write_file(main_path,
+             "# A comment\n"
+             "\n"
+             "  \t\n"
+             "test_int=5\n"
+             "-test_double=0.25\r\n"
+             "  --test_string=a=b # not a comment  \n"
+             "  # --test_bool\n"
+             "--flagfile=" + included_path + "\n"
+             "test_filler_1=3");
+  write_file(included_path, "--test_bool\ntest_filler_10=4\n--test_int=6\n");
+
+  CommandLineValues expected;
+  expected.test_int = 6;
+  expected.test_double = 0.25;
+  expected.test_bool = true;
+  expected.test_string = "a=b # not a comment";
+  expected.test_filler_1 = 3;
+  expected.test_filler_10 = 4;
+  check_flagfile({"test", "--flagfile=" + main_path}, expected);
+
+  // Options take effect in the order given.
+  check_flagfile({"test", "--test_int=9", "-flagfile", main_path}, expected);
+  expected.test_int = 9;
+  check_flagfile({"test", "--flagfile", main_path, "--test_int=9"}, expected);
+
+  // A file filling a whole page ends with a NUL mapped after it.
+  std::string page(4096, '#');
+  const std::string last_line = "\ntest_int=77";
+  page.replace(page.size() - last_line.size(), last_line.size(), last_line);
+  write_file(page_path, page);
+  CommandLineValues page_expected;
+  page_expected.test_int = 77;
+  check_flagfile({"test", "--flagfile=" + page_path}, page_expected);
+
+  write_file(empty_path, "");
+  check_flagfile({"test", "--flagfile=" + empty_path}, CommandLineValues());
+
+  // Errors are reported with the file and line, and parsing goes on.
+  const auto old_error_handler = xflags::error_handler;
+  xflags::error_handler = record_error;
+
+  write_file(self_path,
+             "test_int=1\n"
+             "no_such_flag=1\n"
+             "test_filler_=2\n"
+             "test_bool=maybe\n"
+             "flagfile=" + self_path + "\n"
+             "flagfile=" + dir + "/missing.flags\n"
+             "test_filler_1\n"
+             "test_filler_10=10\n");
+  CommandLineValues error_expected;
+  error_expected.test_int = 1;
+  error_expected.test_filler_10 = 10;
+  check_flagfile({"test", "--flagfile=" + self_path}, error_expected,
+                 {self_path + ":2: Unrecognized option 'no_such_flag=1'",
+                  self_path + ":3: Option 'test_filler_=2' is ambiguous",
+                  "Invalid value --test_bool=maybe",
+                  "Flag file '" + self_path + "' includes itself",
+                  "Could not open flag file '" + dir + "/missing.flags'",
+                  self_path + ":7: Option '--test_filler_1' requires an "
+                              "argument"});
+
+  xflags::error_handler = old_error_handler;
+
+  for (const auto& path : {main_path, included_path, self_path, page_path,
+                           empty_path})
+    unlink(path.c_str());
+  rmdir(directory);
+}
+
+std::string read_file(const std::string& path) {
+  std::ifstream input(path);
+  return std::string(std::istreambuf_iterator<char>(input),
+                     std::istreambuf_iterator<char>());
+}
+
+// Loads the snapshot in `path`, and checks that it fails with an error
+// containing `expected_error`.
+void check_bad_snapshot(const std::string& path,
+                        const std::string& expected_error) {
+  errors.clear();
+  if (xflags::load_snapshot(path.c_str()) || errors.empty() ||
+      errors.front().find(expected_error) == std::string::npos)
+    errx(EXIT_FAILURE, "Wrong result for snapshot with %s: %s",
+         expected_error.c_str(),
+         errors.empty() ? "no error" : errors.front().c_str());
+}
+
+// Snapshots store raw values, so every supported type must survive a round
+// trip, and corrupt files must be rejected.
+void check_snapshots() {
+  char directory_template[] = "/tmp/xflags-test.XXXXXX";
+  const char* directory = mkdtemp(directory_template);
+  if (!directory) err(EXIT_FAILURE, "mkdtemp");
+  const std::string dir = directory;
+  const auto path = dir + "/flags.snapshot";
+  const auto bad_path = dir + "/bad.snapshot";
+
+  CommandLineValues expected;
+  expected.test_int = -5;
+  expected.test_double = 1.25;
+  expected.test_bool = true;
+  expected.test_string = std::string("a\0b", 3);
+  expected.test_filler_1 = 1;
+  expected.test_filler_10 = std::numeric_limits<int32_t>::min();
+  const std::vector<int32_t> expected_list{1, -2, 3};
+  const std::vector<std::string> expected_names{"a", "", "bc"};
+
+  set_values(expected);
+  test_list = expected_list;
+  test_names = expected_names;
+  if (!xflags::save_snapshot(path.c_str()))
+    errx(EXIT_FAILURE, "save_snapshot failed");
+
+  set_values(CommandLineValues());
+  test_list.clear();
+  test_names.clear();
+  if (!xflags::load_snapshot(path.c_str()) || !(get_values() == expected) ||
+      test_list != expected_list || test_names != expected_names)
+    errx(EXIT_FAILURE, "load_snapshot did not restore the saved values");
+
+  // --flagsnapshot applies at its position on the command line.
+  set_values(CommandLineValues());
+  int first;
+  xflags_parse({"test", "--flagsnapshot=" + path, "--test_int=3"}, first);
+  expected.test_int = 3;
+  if (!(get_values() == expected))
+    errx(EXIT_FAILURE, "--flagsnapshot did not restore the saved values");
+
+  const auto old_error_handler = xflags::error_handler;
+  xflags::error_handler = record_error;
+
+  const auto snapshot = read_file(path);
+
+  write_file(bad_path, "XFLGSNP0" + snapshot.substr(8));
+  check_bad_snapshot(bad_path, "Not a flag snapshot");
+
+  write_file(bad_path, snapshot.substr(0, snapshot.size() - 9));
+  check_bad_snapshot(bad_path, "is truncated");
+
+  // The name, file and type of an entry are followed by its payload, each
+  // padded to 8 bytes.
+  const std::string bool_strings = std::string("test_bool") + __FILE__ + "bool";
+  const auto bool_offset = snapshot.find(bool_strings);
+  if (bool_offset == std::string::npos)
+    errx(EXIT_FAILURE, "No entry for test_bool in snapshot");
+  auto bad_snapshot = snapshot;
+  bad_snapshot[bool_offset + ((bool_strings.size() + 7) & ~size_t(7))] = 2;
+  write_file(bad_path, bad_snapshot);
+  check_bad_snapshot(bad_path, "Corrupt value for flag 'test_bool'");
+
+  xflags::error_handler = old_error_handler;
+
+  unlink(path.c_str());
+  unlink(bad_path.c_str());
+  rmdir(directory);
+}
+
+// Returns the values of `shared_ids`.
+std::vector<uint64_t> get_ids() {
+  return std::vector<uint64_t>(shared_ids.begin(), shared_ids.end());
+}
+
+// `publish_shared` hands out a sealed file holding the flag values, and
+// moves `Shared` flags into it.  `attach_shared` restores all values from it.
+void check_shared() {
+  CommandLineValues expected;
+  expected.test_int = 11;
+  expected.test_string = "shared";
+  set_values(expected);
+  int first;
+  xflags_parse({"test", "--shared_ids=1,2,3"}, first);
+  const std::vector<uint64_t> expected_ids{1, 2, 3};
+
+  const auto private_ids = shared_ids.data();
+  const int fd = xflags::publish_shared();
+  if (fd == -1) errx(EXIT_FAILURE, "publish_shared failed");
+  if (!(get_values() == expected) || get_ids() != expected_ids ||
+      shared_ids.data() == private_ids)
+    errx(EXIT_FAILURE, "publish_shared changed the flag values");
+
+#ifdef MFD_ALLOW_SEALING
+  if (!(fcntl(fd, F_GET_SEALS) & F_SEAL_WRITE) || -1 != write(fd, "x", 1))
+    errx(EXIT_FAILURE, "publish_shared returned a writable file");
+#endif
+
+  set_values(CommandLineValues());
+  xflags_parse({"test", "--shared_ids=4"}, first);
+  if (!xflags::attach_shared(fd) || !(get_values() == expected) ||
+      get_ids() != expected_ids)
+    errx(EXIT_FAILURE, "attach_shared did not restore the published values");
+  close(fd);
+}
+
+// Parses `args` with `flag_set` into `values`, exiting on failure.
+void parse_values(const xflags::FlagSet& flag_set,
+                  const std::vector<std::string>& args,
+                  xflags::FlagValues& values) {
+  std::vector<const char*> argv;
+  for (const auto& arg : args) argv.emplace_back(arg.c_str());
+
+  std::string error;
+  if (!flag_set.parse(argv.size(), argv.data(), values, error))
+    errx(EXIT_FAILURE, "FlagSet::parse failed: %s", error.c_str());
+}
+
+// A `FlagValues` holding enough values to be indexed must take flags of
+// plugins loaded after it was first used.
+void check_plugin_values(const std::string& plugin_path) {
+  std::vector<std::string> args{""};
+  for (int i = 0; i < kFillerCount; ++i)
+    args.emplace_back("--test_filler_" + std::to_string(i) + "=1");
+
+  const xflags::FlagSet flag_set;
+  xflags::FlagValues values;
+  parse_values(flag_set, args, values);
+
+  void* plugin = dlopen(plugin_path.c_str(), RTLD_NOW);
+  if (!plugin) errx(EXIT_FAILURE, "%s", dlerror());
+  if (xflags::register_loaded_flags() != 1)
+    errx(EXIT_FAILURE, "register_loaded_flags() missed the plugin's flag");
+  const auto plugin_int =
+      static_cast<const int32_t*>(dlsym(plugin, "test_plugin_int"));
+  if (!plugin_int) errx(EXIT_FAILURE, "%s", dlerror());
+
+  args.emplace_back("--test_plugin_int=7");
+  parse_values(flag_set, args, values);
+  if (values.get(*plugin_int) != 7 || values.get(test_filler_16) != 1)
+    errx(EXIT_FAILURE, "FlagValues lost the value of a plugin's flag");
+}
+
+}  // namespace
+
+int main(int, char** argv) {
+  // Must run first, before anything else builds the flag index.
+  check_parse_allocations();
+
+  check_numbers();
+  check_command_lines();
+  check_ambiguous_options();
+  check_flagfiles();
+  check_snapshots();
+  check_shared();
+
+  // The plugin is built next to this program.
+  const std::string program = argv[0];
+  const auto slash = program.find_last_of('/');
+  const auto directory =
+      (slash == std::string::npos) ? "./" : program.substr(0, slash + 1);
+  check_plugin_values(directory + "xflags-test-plugin.so");
+}
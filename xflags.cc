@@ -1,14 +1,30 @@
 #include <algorithm>
 #include <cerrno>
+#include <csignal>
+#include <cstdarg>
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <limits>
+#include <mutex>
+#include <thread>
 #include <type_traits>
 
 #include "xflags.h"
 
 #include <err.h>
+#include <fcntl.h>
+#include <link.h>
+#include <locale.h>
+#include <malloc.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/termios.h>
 #include <sysexits.h>
 #include <unistd.h>
@@ -17,33 +33,316 @@ namespace xflags {
 
 void (*error_handler)(int eval, const char* fmt, ...) = errx;
 
+const char* environment_prefix = nullptr;
+
+void (*profile_handler)(const ParseProfile& profile) = nullptr;
+
 namespace {
 
+// Aligns the `xflags_data` section to a cache line, also in programs that
+// don't link the page of padding from xflags-data.cc.
+alignas(64) char data_anchor XFLAGS_DATA __attribute__((used));
+
+// Objects replaced by a reload or by adding flags, waiting for `reclaim()`.
+std::mutex retired_mutex;
+std::vector<std::pair<const void*, void (*)(const void*)>> retired;
+
+void retire(const void* value, void (*deleter)(const void*)) {
+  std::lock_guard<std::mutex> lock(retired_mutex);
+  retired.emplace_back(value, deleter);
+}
+
+// The flags of other loaded objects, which follow those in the `xflags`
+// section of the object linking this library.  Replaced by
+// `register_loaded_flags`, and never modified once published, so that
+// threads can read it while flags are added.
+typedef std::vector<const FlagInfo*> FlagList;
+std::atomic<const FlagList*> other_flags{nullptr};
+
+// Returns the number of flags in the `xflags` section of this object.
+int own_flag_count() { return __stop_xflags - __start_xflags; }
+
+// Returns the number of exported flags.
+int flag_count() {
+  const auto flags = other_flags.load(std::memory_order_acquire);
+  return own_flag_count() + (flags ? flags->size() : 0);
+}
+
+// Returns the flag at position `val`, counting from 1 so that 0 can mean
+// "no flag".
+const FlagInfo& flag_at(int val) {
+  const auto own_count = own_flag_count();
+  if (val <= own_count) return __start_xflags[val - 1];
+  // Lists only grow, so a later one than that `val` came from holds it too.
+  return *(*other_flags.load(std::memory_order_acquire))[val - own_count - 1];
+}
+
+// Serializes replacing `other_flags` and the indexes over the flags.
+std::mutex registry_mutex;
+
 const char nul = '\0';
 
-// Parses signed integers.
+// Returns true for the characters `isspace` accepts in the "C" locale.
+bool is_space(char ch) {
+  return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+// Returns the value of a hexadecimal digit, or 16 if `ch` is not one.
+unsigned hex_digit_value(char ch) {
+  if (ch >= '0' && ch <= '9') return ch - '0';
+  if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+  if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+  return 16;
+}
+
+// Returns true if an 8 byte load at `ptr` cannot cross into the next page,
+// and therefore cannot fault even if the string ends before `ptr + 8`.
+bool can_load_8(const char* ptr) {
+  return (reinterpret_cast<uintptr_t>(ptr) & 4095) <= 4096 - 8;
+}
+
+// Loads 8 bytes as a little-endian integer.  The caller must have checked
+// `can_load_8`; the bytes past the end of the string are inspected but never
+// used.
+__attribute__((no_sanitize_address)) uint64_t load_8(const char* ptr) {
+  uint64_t result;
+  std::memcpy(&result, ptr, sizeof(result));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  result = __builtin_bswap64(result);
+#endif
+  return result;
+}
+
+// Returns true if all 8 bytes of `chunk` are ASCII digits.
+bool is_8_digits(uint64_t chunk) {
+  return 0 == (((chunk & UINT64_C(0xF0F0F0F0F0F0F0F0)) |
+                (((chunk + UINT64_C(0x0606060606060606)) &
+                  UINT64_C(0xF0F0F0F0F0F0F0F0)) >> 4)) ^
+               UINT64_C(0x3333333333333333));
+}
+
+// Converts 8 ASCII digits, with the first digit in the low byte, to their
+// value, using three multiplications instead of eight.
+uint32_t parse_8_digits(uint64_t chunk) {
+  chunk -= UINT64_C(0x3030303030303030);
+  chunk = (chunk * 10) + (chunk >> 8);
+  const uint64_t mask = UINT64_C(0x000000FF000000FF);
+  const uint64_t mul1 = UINT64_C(0x000F424000000064);  // 100 + (1000000 << 32)
+  const uint64_t mul2 = UINT64_C(0x0000271000000001);  // 1 + (10000 << 32)
+  return static_cast<uint32_t>(
+      (((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32);
+}
+
+// Parses the digits of an unsigned integer in `base` starting at `ptr`.
+// Returns a pointer past the last digit, and sets `overflow` if the value
+// does not fit in 64 bits.
+const char* parse_digits(const char* ptr, unsigned base, uint64_t& value,
+                         bool& overflow) {
+  const uint64_t max = std::numeric_limits<uint64_t>::max();
+  value = 0;
+  overflow = false;
+
+  if (base == 10) {
+    // Nineteen decimal digits always fit in 64 bits, so the first ones can be
+    // converted eight at a time without overflow checks.
+    int digit_count = 0;
+    while (digit_count + 8 <= 19 && can_load_8(ptr)) {
+      const auto chunk = load_8(ptr);
+      if (!is_8_digits(chunk)) break;
+      value = value * 100000000 + parse_8_digits(chunk);
+      ptr += 8;
+      digit_count += 8;
+    }
+    for (; digit_count < 19 && *ptr >= '0' && *ptr <= '9'; ++ptr, ++digit_count)
+      value = value * 10 + (*ptr - '0');
+  }
+
+  for (unsigned digit; (digit = hex_digit_value(*ptr)) < base; ++ptr) {
+    if (value > (max - digit) / base) overflow = true;
+    value = value * base + digit;
+  }
+
+  return ptr;
+}
+
+// Parses integers with the same syntax and results as `strtoll` and
+// `strtoull` with base 0, but without consulting the locale or `errno`.  As
+// with `strtoull`, unsigned values may be negated modulo 2^64.
 template <typename T>
-typename std::enable_if<std::numeric_limits<T>::is_signed, bool>::type
-parse_integer(void* target, const char* string, const char** endptr) {
-  errno = 0;
-  auto result = std::strtoll(string, const_cast<char**>(endptr), 0);
-  if (errno != 0 || result > std::numeric_limits<T>::max() ||
-      result < std::numeric_limits<T>::min() || *endptr == string)
+bool parse_integer(void* target, const char* string, const char** endptr) {
+  const char* ptr = string;
+  while (is_space(*ptr)) ++ptr;
+
+  const bool negative = (*ptr == '-');
+  if (*ptr == '-' || *ptr == '+') ++ptr;
+
+  unsigned base = 10;
+  if (ptr[0] == '0') {
+    if ((ptr[1] == 'x' || ptr[1] == 'X') && hex_digit_value(ptr[2]) < 16) {
+      base = 16;
+      ptr += 2;
+    } else {
+      base = 8;
+    }
+  }
+
+  uint64_t magnitude;
+  bool overflow;
+  const char* digits_end = parse_digits(ptr, base, magnitude, overflow);
+  if (digits_end == ptr) {
+    *endptr = string;
+    return false;
+  }
+  *endptr = digits_end;
+  if (overflow) return false;
+
+  if (std::numeric_limits<T>::is_signed) {
+    const uint64_t limit =
+        negative ? uint64_t(0) - static_cast<uint64_t>(
+                                     std::numeric_limits<T>::min())
+                 : static_cast<uint64_t>(std::numeric_limits<T>::max());
+    if (magnitude > limit) return false;
+    *reinterpret_cast<T*>(target) =
+        negative ? static_cast<T>(uint64_t(0) - magnitude)
+                 : static_cast<T>(magnitude);
+  } else {
+    const uint64_t result = negative ? uint64_t(0) - magnitude : magnitude;
+    if (result > static_cast<uint64_t>(std::numeric_limits<T>::max()))
+      return false;
+    *reinterpret_cast<T*>(target) = static_cast<T>(result);
+  }
+
+  return true;
+}
+
+// Returns the "C" locale, used for the cases the fast floating point path
+// below does not handle.
+locale_t c_locale() {
+  static const locale_t locale = newlocale(LC_ALL_MASK, "C", nullptr);
+  return locale;
+}
+
+// A decimal number of the form [+-]digits[.digits][e[+-]digits], split into
+// an integer mantissa and a power of ten.
+struct Decimal {
+  bool negative;
+  uint64_t mantissa;
+  int64_t exponent;
+  const char* end;
+};
+
+// Splits a plain decimal number into a `Decimal`.  Returns false if the input
+// uses syntax only `strtod` understands, such as hexadecimal notation,
+// infinity or NaN, leading white space, or has more than 19 significant
+// digits.
+bool parse_decimal(const char* string, Decimal& result) {
+  const char* ptr = string;
+
+  result.negative = (*ptr == '-');
+  if (*ptr == '-' || *ptr == '+') ++ptr;
+
+  // Leave "0x..." to strtod.
+  if (ptr[0] == '0' && (ptr[1] == 'x' || ptr[1] == 'X')) return false;
+
+  uint64_t mantissa = 0;
+  int significant_digits = 0;
+  int64_t exponent = 0;
+  bool any_digits = false;
+
+  for (; *ptr >= '0' && *ptr <= '9'; ++ptr) {
+    any_digits = true;
+    if (mantissa == 0 && *ptr == '0') continue;
+    if (++significant_digits > 19) return false;
+    mantissa = mantissa * 10 + (*ptr - '0');
+  }
+
+  if (*ptr == '.') {
+    ++ptr;
+    for (; *ptr >= '0' && *ptr <= '9'; ++ptr) {
+      any_digits = true;
+      if (mantissa == 0 && *ptr == '0') {
+        --exponent;
+        continue;
+      }
+      if (++significant_digits > 19) return false;
+      mantissa = mantissa * 10 + (*ptr - '0');
+      --exponent;
+    }
+  }
+
+  if (!any_digits) return false;
+
+  if (*ptr == 'e' || *ptr == 'E') {
+    const char* exponent_ptr = ptr + 1;
+    const bool negative_exponent = (*exponent_ptr == '-');
+    if (*exponent_ptr == '-' || *exponent_ptr == '+') ++exponent_ptr;
+
+    // Without digits, the 'e' is not part of the number.
+    if (*exponent_ptr >= '0' && *exponent_ptr <= '9') {
+      int64_t explicit_exponent = 0;
+      for (; *exponent_ptr >= '0' && *exponent_ptr <= '9'; ++exponent_ptr) {
+        if (explicit_exponent < 100000)
+          explicit_exponent = explicit_exponent * 10 + (*exponent_ptr - '0');
+      }
+      exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+      ptr = exponent_ptr;
+    }
+  }
+
+  result.mantissa = mantissa;
+  result.exponent = (mantissa == 0) ? 0 : exponent;
+  result.end = ptr;
+  return true;
+}
+
+// Converts a `Decimal` to `T` with a single correctly rounded multiplication
+// or division, if both the mantissa and the power of ten are exactly
+// representable in `T` (Clinger's fast path).  Returns false otherwise.
+template <typename T>
+bool decimal_to_float(const Decimal& decimal, T& result) {
+#if FLT_EVAL_METHOD == 0
+  static const T powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                             1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                             1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const int max_exponent = std::is_same<T, float>::value ? 10 : 22;
+  const uint64_t max_mantissa = uint64_t(1)
+                                << std::numeric_limits<T>::digits;
+
+  if (decimal.mantissa > max_mantissa ||
+      decimal.exponent < -max_exponent || decimal.exponent > max_exponent)
     return false;
-  *reinterpret_cast<T*>(target) = result;
+
+  result = static_cast<T>(decimal.mantissa);
+  if (decimal.exponent < 0)
+    result /= powers[-decimal.exponent];
+  else
+    result *= powers[decimal.exponent];
+  if (decimal.negative) result = -result;
+
   return true;
+#else
+  return false;
+#endif
 }
 
-// Parses unsigned integers.
+// Parses floating point numbers like `strtof` and `strtod` in the "C"
+// locale.  Plain decimal numbers of moderate precision take a fast path that
+// yields the same, correctly rounded, result; anything else goes to
+// `strtof_l`/`strtod_l`.
 template <typename T>
-typename std::enable_if<!std::numeric_limits<T>::is_signed, bool>::type
-parse_integer(void* target, const char* string, const char** endptr) {
+bool parse_float(void* target, const char* string, const char** endptr,
+                 T (*fallback)(const char*, char**, locale_t)) {
+  Decimal decimal;
+  if (parse_decimal(string, decimal) &&
+      decimal_to_float(decimal, *reinterpret_cast<T*>(target))) {
+    *endptr = decimal.end;
+    return true;
+  }
+
   errno = 0;
-  auto result = std::strtoull(string, const_cast<char**>(endptr), 0);
-  if (errno != 0 || result > std::numeric_limits<T>::max() ||
-      result < std::numeric_limits<T>::min() || *endptr == string)
-    return false;
-  *reinterpret_cast<T*>(target) = result;
+  *reinterpret_cast<T*>(target) =
+      fallback(string, const_cast<char**>(endptr), c_locale());
+  if (errno != 0 || *endptr == string) return false;
   return true;
 }
 
@@ -52,29 +351,22 @@ parse_integer(void* target, const char* string, const char** endptr) {
 // Parses float values.
 bool Parser<float>::parse(void* target, const char* string,
                           const char** endptr) {
-  errno = 0;
-  *reinterpret_cast<float*>(target) =
-      std::strtof(string, const_cast<char**>(endptr));
-  if (errno != 0 || *endptr == string) return false;
-  return true;
+  return parse_float<float>(target, string, endptr, strtof_l);
 }
 
 // Parses double values.
 bool Parser<double>::parse(void* target, const char* string,
                            const char** endptr) {
-  errno = 0;
-  *reinterpret_cast<double*>(target) =
-      std::strtod(string, const_cast<char**>(endptr));
-  if (errno != 0 || *endptr == string) return false;
-  return true;
+  return parse_float<double>(target, string, endptr, strtod_l);
 }
 
-// Parses long double values.
+// Parses long double values.  The fast path is not used here, since the
+// precision of long double varies between platforms.
 bool Parser<long double>::parse(void* target, const char* string,
                                 const char** endptr) {
   errno = 0;
   *reinterpret_cast<long double*>(target) =
-      std::strtold(string, const_cast<char**>(endptr));
+      strtold_l(string, const_cast<char**>(endptr), c_locale());
   if (errno != 0 || *endptr == string) return false;
   return true;
 }
@@ -134,152 +426,2122 @@ bool Parser<std::string>::parse(void* target, const char* string,
   return true;
 }
 
+size_t parallel_parse_threshold = 1 << 20;
+
+namespace {
+
+// Runs `function(i)` for each `i` in [0, count), each on its own thread.
+template <typename Function>
+void run_in_parallel(size_t count, const Function& function) {
+  std::vector<std::thread> threads;
+  threads.reserve(count - 1);
+  for (size_t i = 1; i < count; ++i) threads.emplace_back(function, i);
+  function(0);
+  for (auto& thread : threads) thread.join();
+}
+
+// The first error found in a chunk of a list.
+struct ListError {
+  size_t index = std::numeric_limits<size_t>::max();
+  // If not nullptr, the value at `index` ends with garbage starting here.
+  // Otherwise, it could not be parsed at all.
+  const char* garbage = nullptr;
+};
+
+}  // namespace
+
+bool parse_list_in_parallel(const char* string, size_t length,
+                            size_t element_size,
+                            bool (*parse)(void* target, const char* string,
+                                          const char** endptr),
+                            void* (*allocate)(void* context, size_t count),
+                            void* context, size_t& parsed,
+                            const char** endptr) {
+  const char* string_end = string + length;
+
+  size_t thread_count = std::thread::hardware_concurrency();
+  thread_count = std::min<size_t>(thread_count, 8);
+  thread_count = std::min<size_t>(thread_count, length >> 16);
+  if (thread_count == 0) thread_count = 1;
+
+  // Split the string into chunks of whole values.  Each chunk but the last
+  // ends right before a comma.
+  std::vector<const char*> chunks{string};
+  for (size_t i = 1; i < thread_count; ++i) {
+    const char* split = string + length / thread_count * i;
+    if (split < chunks.back()) continue;
+    auto comma =
+        static_cast<const char*>(std::memchr(split, ',', string_end - split));
+    if (!comma) break;
+    if (comma + 1 > chunks.back()) chunks.emplace_back(comma + 1);
+  }
+  chunks.emplace_back(string_end + 1);
+
+  const auto chunk_count = chunks.size() - 1;
+  auto chunk_end = [&](size_t i) { return chunks[i + 1] - 1; };
+
+  // Count the values in each chunk, then find where each chunk's values go.
+  std::vector<size_t> offsets(chunk_count + 1, 0);
+  run_in_parallel(chunk_count, [&](size_t i) {
+    size_t count = 1;
+    for (auto ptr = chunks[i]; ptr != chunk_end(i); ++ptr)
+      count += (*ptr == ',');
+    offsets[i + 1] = count;
+  });
+  for (size_t i = 0; i < chunk_count; ++i) offsets[i + 1] += offsets[i];
+
+  const auto values = static_cast<char*>(allocate(context, offsets.back()));
+
+  std::vector<ListError> errors(chunk_count);
+  run_in_parallel(chunk_count, [&](size_t i) {
+    const char* value = chunks[i];
+    for (auto index = offsets[i]; index != offsets[i + 1]; ++index) {
+      const char* value_end;
+      if (!parse(values + index * element_size, value, &value_end)) {
+        errors[i].index = index;
+        return;
+      }
+      const bool last = index + 1 == offsets[i + 1];
+      if (last ? value_end != chunk_end(i) : *value_end != ',') {
+        errors[i].index = index;
+        errors[i].garbage = value_end;
+        return;
+      }
+      value = value_end + 1;
+    }
+  });
+
+  // Report the first error, like parsing the values in order would.
+  for (const auto& error : errors) {
+    if (error.index == std::numeric_limits<size_t>::max()) continue;
+    parsed = error.index + 1;
+    if (!error.garbage) return false;
+    *endptr = error.garbage;
+    return true;
+  }
+
+  parsed = offsets.back();
+  *endptr = string_end;
+  return true;
+}
+
+namespace {
+
+// Set by `map_array` when it has reported why a value couldn't be parsed, so
+// that `parse_value` doesn't report it again.
+thread_local bool parse_error_reported = false;
+
+// Reports an error found by `map_array`.
+template <typename... Args>
+void report_map_error(int eval, const char* fmt, Args... args) {
+  error_handler(eval, fmt, args...);
+  parse_error_reported = true;
+}
+
+}  // namespace
+
+const void* map_array(const char* path, size_t element_size, size_t alignment,
+                      unsigned hints, size_t& size) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    report_map_error(EX_NOINPUT, "Could not open '%s': %s", path,
+                     std::strerror(errno));
+    return nullptr;
+  }
+
+  struct stat st;
+  if (-1 == fstat(fd, &st)) {
+    report_map_error(EX_IOERR, "Could not stat '%s': %s", path,
+                     std::strerror(errno));
+    close(fd);
+    return nullptr;
+  }
+
+  size = st.st_size;
+  if (size % element_size) {
+    report_map_error(EX_DATAERR,
+                     "'%s' is %zu bytes long, which is not a multiple of %zu",
+                     path, size, element_size);
+    close(fd);
+    return nullptr;
+  }
+
+  // An empty array needs no mapping, but must not be null.
+  static const uint64_t empty[1] = {};
+  if (size == 0) {
+    close(fd);
+    return empty;
+  }
+
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (hints & kMapPopulate) flags |= MAP_POPULATE;
+#endif
+  void* data = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    report_map_error(EX_IOERR, "Could not map '%s': %s", path,
+                     std::strerror(errno));
+    return nullptr;
+  }
+
+  // Mappings start at page boundaries, so this only fails for types with
+  // unusual alignment requirements.
+  if (reinterpret_cast<uintptr_t>(data) % alignment) {
+    report_map_error(EX_DATAERR,
+                     "'%s' could not be mapped with %zu-byte alignment", path,
+                     alignment);
+    munmap(data, size);
+    return nullptr;
+  }
+
+  if (hints & kMapWillNeed) madvise(data, size, MADV_WILLNEED);
+  if (hints & kMapSequential) madvise(data, size, MADV_SEQUENTIAL);
+  if (hints & kMapRandom) madvise(data, size, MADV_RANDOM);
+
+  return data;
+}
+
+namespace {
+
+// The note emitted by `XFLAGS_NOTE_ASM`.
+const char kNoteName[] = "xflags";
+const uint32_t kNoteType = 1;
+
+// Value of `dlpi_adds` when loaded objects were last searched for flags.
+unsigned long long registered_adds = 0;
+
+// The `xflags` sections of other objects whose flags were added, sorted.
+std::vector<const FlagInfo*> registered_sections;
+
+// Returns the address stored as an offset from the 32-bit field at `field`.
+const FlagInfo* resolve_note_offset(const char* field) {
+  int32_t offset;
+  std::memcpy(&offset, field, sizeof(offset));
+  return reinterpret_cast<const FlagInfo*>(reinterpret_cast<uintptr_t>(field) +
+                                           offset);
+}
+
+// Adds the flags of the `xflags` section described by the descriptor of an
+// xflags note to `flags`, unless they were added before.
+void register_section(const char* descriptor, FlagList& flags) {
+  const auto begin = resolve_note_offset(descriptor);
+  const auto end = resolve_note_offset(descriptor + 4);
+  if (begin == __start_xflags || begin == end) return;
+
+  const auto position = std::lower_bound(
+      registered_sections.begin(), registered_sections.end(), begin,
+      std::less<const FlagInfo*>());
+  if (position != registered_sections.end() && *position == begin) return;
+  registered_sections.insert(position, begin);
+
+  for (auto flag = begin; flag != end; ++flag) flags.emplace_back(flag);
+}
+
+// Adds the flags found in the notes of the loaded object `info` to `flags`.
+void register_object(const dl_phdr_info& info, FlagList& flags) {
+  for (int i = 0; i < info.dlpi_phnum; ++i) {
+    const auto& segment = info.dlpi_phdr[i];
+    if (segment.p_type != PT_NOTE) continue;
+
+    const size_t alignment = (segment.p_align == 8) ? 8 : 4;
+    auto align = [alignment](size_t size) {
+      return (size + alignment - 1) & ~(alignment - 1);
+    };
+
+    const char* note =
+        reinterpret_cast<const char*>(info.dlpi_addr + segment.p_vaddr);
+    size_t remaining = segment.p_memsz;
+
+    while (remaining >= sizeof(ElfW(Nhdr))) {
+      ElfW(Nhdr) header;
+      std::memcpy(&header, note, sizeof(header));
+      const size_t name_size = align(header.n_namesz);
+      const size_t descriptor_size = align(header.n_descsz);
+      if (remaining - sizeof(header) < name_size ||
+          remaining - sizeof(header) - name_size < descriptor_size)
+        break;
+
+      const char* name = note + sizeof(header);
+      if (header.n_type == kNoteType && header.n_namesz == sizeof(kNoteName) &&
+          header.n_descsz == 8 &&
+          0 == std::memcmp(name, kNoteName, sizeof(kNoteName)))
+        register_section(name + name_size, flags);
+
+      const size_t note_size = sizeof(header) + name_size + descriptor_size;
+      note += note_size;
+      remaining -= note_size;
+    }
+  }
+}
+
+}  // namespace
+
+size_t register_loaded_flags() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+
+  struct Search {
+    const FlagList* old_flags;
+    FlagList flags;
+    bool first;
+  } search{other_flags.load(std::memory_order_relaxed), FlagList(), true};
+
+  dl_iterate_phdr(
+      [](dl_phdr_info* info, size_t size, void* data) {
+        auto& search = *static_cast<Search*>(data);
+        if (search.first) {
+          search.first = false;
+          // `dlpi_adds` counts the objects loaded so far, so the search can
+          // be skipped if nothing was loaded since the last one.
+          if (size >= offsetof(dl_phdr_info, dlpi_subs)) {
+            if (info->dlpi_adds == registered_adds) return 1;
+            registered_adds = info->dlpi_adds;
+          }
+          // Other threads may be reading the published list.
+          if (search.old_flags) search.flags = *search.old_flags;
+        }
+        register_object(*info, search.flags);
+        return 0;
+      },
+      &search);
+
+  const size_t old_count = search.old_flags ? search.old_flags->size() : 0;
+  if (search.flags.size() <= old_count) return 0;
+  const auto added = search.flags.size() - old_count;
+
+  other_flags.store(new FlagList(std::move(search.flags)),
+                    std::memory_order_release);
+  if (search.old_flags) {
+    retire(search.old_flags, [](const void* ptr) {
+      delete static_cast<const FlagList*>(ptr);
+    });
+  }
+  return added;
+}
+
 std::vector<option> get_options(int val_base) {
+  register_loaded_flags();
+
   std::vector<option> options;
-  options.reserve(&end - &begin);
+  options.reserve(flag_count() + 1);
 
   int option_idx = 1;
-  for (int option_idx = 1; &begin + option_idx != &end; ++option_idx) {
-    const FlagInfo& info = **(&begin + option_idx);
+  for (int option_idx = 1; option_idx <= flag_count(); ++option_idx) {
+    const FlagInfo& info = flag_at(option_idx);
 
     options.emplace_back(
-        option{info.name,
-               info.requires_argument ? required_argument : optional_argument,
+        option{info.name(),
+               info.requires_argument() ? required_argument : optional_argument,
                nullptr, option_idx + static_cast<int>(val_base)});
   }
 
   return options;
 }
 
-void parse_flag(int val, const char* optarg) {
-  static const auto option_count = &end - &begin - 1;
+namespace {
 
-  if (val < 1 || &begin + val >= &end) {
-    error_handler(EXIT_FAILURE, "Invalid option value");
-    return;
-  }
+// Measurements taken while `parse` runs with profiling enabled.
+struct ProfileState {
+  ParseProfile profile;
+
+  // Measurements for each flag, indexed by flag position.
+  std::vector<FlagProfile> flags;
 
-  const FlagInfo& info = **(&begin + val);
+  uint64_t start_ns = 0;
 
+  // True if `--xflags_profile` was given.
+  bool print_json = false;
+};
+
+uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Returns the number of bytes of heap memory in use, or 0 if unknown.
+int64_t heap_in_use() {
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  const auto info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+// The type of `error_handler`.
+typedef void (*ErrorHandler)(int eval, const char* fmt, ...);
+
+void parse_value(const FlagInfo& info, const char* optarg,
+                 ErrorHandler report) {
   const char* endptr = nullptr;
-  if (!info.parse(info.data, optarg, &endptr))
-    error_handler(EX_USAGE, "Invalid value --%s=%s", info.name, optarg);
+  const auto binding = info.bind();
+  if (!binding.parse(binding.data, optarg, &endptr)) {
+    if (parse_error_reported)
+      parse_error_reported = false;
+    else
+      report(EX_USAGE, "Invalid value --%s=%s", info.name(), optarg);
+    return;
+  }
 
   if (*endptr != '\0')
-    error_handler(EX_USAGE, "Garbage in value --%s=%s: %s", info.name, optarg,
-                  endptr);
+    report(EX_USAGE, "Garbage in value --%s=%s: %s", info.name(), optarg,
+           endptr);
 }
 
-void parse(int argc, char** argv) {
-  if (argc == 0) return;
+// Implements `parse_flag`, reporting errors to `report`, and recording the
+// time taken in `profile` unless it's nullptr.
+void parse_flag(int val, const char* optarg, ErrorHandler report,
+                ProfileState* profile) {
+  if (val < 1 || val > flag_count()) {
+    report(EXIT_FAILURE, "Invalid option value");
+    return;
+  }
 
-  int do_print_help = 0;
+  const FlagInfo& info = flag_at(val);
 
-  auto options = get_options();
-  options.emplace_back(option{"help", no_argument, &do_print_help, 1});
-  options.emplace_back(option{nullptr, 0, nullptr, 0});
+  if (!profile) {
+    parse_value(info, optarg, report);
+    return;
+  }
 
-  int i;
-  while (-1 != (i = getopt_long_only(argc, argv, "", options.data(), 0))) {
-    if (i == 0) break;
+  const auto heap_before = heap_in_use();
+  const auto start = now_ns();
+  parse_value(info, optarg, report);
+  const auto elapsed = now_ns() - start;
 
-    if (i == '?') {
-      error_handler(EX_USAGE, "Try '%s --help' for more information.", argv[0]);
-      return;
-    }
+  auto& flag = profile->flags[val];
+  flag.flag = &info;
+  flag.type = info.bind().type();
+  ++flag.calls;
+  flag.ns += elapsed;
+  flag.heap_bytes += heap_in_use() - heap_before;
+}
 
-    parse_flag(i, optarg);
-  }
+}  // namespace
 
-  if (do_print_help) {
-    std::cout << "Usage: " << argv[0] << " [OPTION]...\n\n";
-    print_help();
-    std::cout << "      --help                 display this help and exit\n";
-    std::exit(EXIT_SUCCESS);
-  }
+void parse_flag(int val, const char* optarg) {
+  parse_flag(val, optarg, error_handler, nullptr);
 }
 
-void print_help() {
-  static const auto option_count = &end - &begin - 1;
-  if (option_count == 0) return;
+namespace {
 
-  uint16_t column_count = 80;
+// Values returned by `find_option` for the options `parse` adds on its own.
+const int kHelpOption = -1;
+const int kFlagfileOption = -2;
+const int kProfileOption = -3;
+const int kValidateAllOption = -4;
+const int kSnapshotOption = -5;
 
-  winsize ws;
-  if (0 == ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws)) {
-    column_count = ws.ws_col;
-    if (column_count > 100) column_count = 100;
+// Returned by `find_option` when a prefix matches more than one option.
+const int kAmbiguousOption = std::numeric_limits<int>::min();
+
+// Options added by `parse` in addition to the exported flags.
+const option kBuiltinOptions[] = {
+    {"help", optional_argument, nullptr, kHelpOption},
+    {"flagfile", required_argument, nullptr, kFlagfileOption},
+    {"xflags_profile", no_argument, nullptr, kProfileOption},
+    {"xflags_validate_all", no_argument, nullptr, kValidateAllOption},
+    {"flagsnapshot", required_argument, nullptr, kSnapshotOption},
+};
+
+// State shared between the command line and any flag files it includes.
+struct ParseState {
+  bool print_help = false;
+
+  // The value of `--help`: nullptr for text, or "json".
+  const char* help_format = nullptr;
+
+  // Indexed by flag position, true for flags set by the command line or
+  // flag files.  Only tracked when `environment_prefix` is set.
+  std::vector<bool> set_flags;
+
+  // True if `--xflags_validate_all` was given.
+  bool validate_all = false;
+
+  // The profile being recorded, or nullptr if profiling is disabled, and
+  // the storage for enabling it.
+  ProfileState* profile = nullptr;
+  ProfileState* profile_storage = nullptr;
+
+  // True if parsing the flag file given to `enable_reload`.  Only
+  // `Reloadable` flags are set in this case.
+  bool reloading = false;
+
+  // Receives the errors found while parsing.  Set instead of `error_handler`
+  // when reloading, since other threads may be using that.
+  ErrorHandler report = error_handler;
+};
+
+// A flag file currently being parsed.  Used to detect include cycles.
+struct FlagfileFrame {
+  dev_t device;
+  ino_t inode;
+  const FlagfileFrame* parent;
+};
+
+// Hashes the first `length` bytes of `name` using 64-bit FNV-1a.
+uint64_t hash_name(const char* name, size_t length) {
+  uint64_t hash = UINT64_C(14695981039346656037);
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= static_cast<unsigned char>(name[i]);
+    hash *= UINT64_C(1099511628211);
   }
+  return hash;
+}
 
-  const char* file = nullptr;
-  const bool multiple_files = (*(&begin + 1))->file != (*(&end - 1))->file;
+// Returns true if `name` is exactly the `length` first bytes of `string`.
+bool name_equals(const char* name, const char* string, size_t length) {
+  return 0 == std::strncmp(name, string, length) && name[length] == '\0';
+}
 
-  for (auto fp = &begin + 1; fp != &end; ++fp) {
-    const FlagInfo& info = **fp;
+// Storage for the flag index of programs with up to 4096 flags, so that
+// `parse` needs no heap allocation in the common case.  Pages of this array
+// that aren't used are never touched, and so cost nothing.
+uint32_t static_slots[8192];
 
-    if (info.file != file && multiple_files) {
-      if (file != nullptr) std::cout.put('\n');
-      std::cout << "Options in " << info.file << ":\n";
-      file = info.file;
-    }
-    const auto name_length = std::char_traits<char>::length(info.name);
+// An open-addressing hash table over the names of the flags at positions 1 to
+// `count`.  Each slot holds the position of a flag, as used for
+// `parse_flag`, or 0 if the slot is empty.  The table size is a power of two
+// at least twice the number of flags, so probe sequences stay short.
+struct FlagIndex {
+  uint32_t* slots;
+  size_t mask;
+  int count;
+};
 
-    std::cout << "      --";
-    std::cout.write(info.name, name_length);
+// The first index built, if its slots fit in `static_slots`.
+FlagIndex static_index;
 
-    size_t column = name_length + 8;
+// The current index.  Replaced by `update_flag_index`, and never modified
+// once published, so that threads can search it while flags are added.
+std::atomic<const FlagIndex*> flag_index{nullptr};
 
-    if (info.placeholder) {
-      const auto placeholder_length =
-          std::char_traits<char>::length(info.placeholder);
-      std::cout.put('=');
-      std::cout.write(info.placeholder, placeholder_length);
+void insert_flag(const FlagIndex& index, int val) {
+  const char* name = flag_at(val).name();
+  const auto length = std::char_traits<char>::length(name);
 
-      column += placeholder_length + 1;
+  for (auto slot = hash_name(name, length);; ++slot) {
+    auto& entry = index.slots[slot & index.mask];
+    if (entry == 0) {
+      entry = val;
+      return;
     }
+    // Like getopt, let the first of several identical names win.
+    if (name_equals(flag_at(entry).name(), name, length)) return;
+  }
+}
 
-    if (column >= 28) {
-      std::cout.put('\n');
-      column = 0;
-    }
+// Publishes an index including the flags registered since the current one
+// was built.  The slots of the current index are copied unless it has to
+// grow, which doubles its size.
+void update_flag_index() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
 
-    const char* range_begin = info.description;
-    size_t description_column = 29;
+  const auto old_index = flag_index.load(std::memory_order_relaxed);
+  const auto option_count = flag_count();
+  if (old_index && old_index->count == option_count) return;
 
-    while (*range_begin) {
-      while (column < description_column) {
-        std::cout.put(' ');
-        ++column;
-      }
+  size_t slot_count = old_index ? old_index->mask + 1 : 1;
+  while (slot_count < 2 * static_cast<size_t>(option_count)) slot_count <<= 1;
 
-      const char* range_end = range_begin;
+  // The heap is only used for very large programs, and once flags are added
+  // after the first index was built.
+  FlagIndex* index = &static_index;
+  const size_t static_count = sizeof(static_slots) / sizeof(*static_slots);
+  if (!old_index && slot_count <= static_count)
+    static_index.slots = static_slots;
+  else
+    index = new FlagIndex{new uint32_t[slot_count](), 0, 0};
+  index->mask = slot_count - 1;
+  index->count = option_count;
 
-      // We put at least one word per line, regardless of length.
-      while (*range_end && *range_end != ' ') ++range_end;
+  int first = 0;
+  if (old_index && old_index->mask == index->mask) {
+    std::copy(old_index->slots, old_index->slots + slot_count, index->slots);
+    first = old_index->count;
+  }
+  for (int val = first + 1; val <= option_count; ++val)
+    insert_flag(*index, val);
 
-      // Try to fit more words on the line.
-      for (const char* c = range_end; c - range_begin + column < column_count;
-           ++c) {
-        if (*c == '\0' || std::isspace(*c)) {
-          range_end = c;
-          if (*c == '\0' || *c == '\n') break;
-        }
-      }
+  flag_index.store(index, std::memory_order_release);
+  if (old_index && old_index != &static_index) {
+    retire(old_index, [](const void* ptr) {
+      const auto index = static_cast<const FlagIndex*>(ptr);
+      delete[] index->slots;
+      delete index;
+    });
+  }
+}
 
-      std::cout.write(range_begin, range_end - range_begin);
-      std::cout.put('\n');
-      column = 0;
+// Returns the position of the flag whose name is exactly the `length` first
+// bytes of `name`, or 0 if there is no such flag.
+int find_flag(const char* name, size_t length) {
+  auto index = flag_index.load(std::memory_order_acquire);
+  if (!index || index->count != flag_count()) {
+    update_flag_index();
+    index = flag_index.load(std::memory_order_acquire);
+  }
 
-      while (*range_end != '\0' && std::isspace(*range_end)) ++range_end;
+  for (auto slot = hash_name(name, length);; ++slot) {
+    const auto val = index->slots[slot & index->mask];
+    if (val == 0 || name_equals(flag_at(val).name(), name, length))
+      return val;
+  }
+}
 
-      range_begin = range_end;
-      description_column = 31;
-    }
+// Returns the name of an option returned by `find_option`.
+const char* option_name(int val) {
+  if (val > 0) return flag_at(val).name();
+  for (const auto& builtin : kBuiltinOptions) {
+    if (builtin.val == val) return builtin.name;
+  }
+  return nullptr;
+}
+
+// Returns `no_argument`, `required_argument` or `optional_argument` for an
+// option returned by `find_option`, like the `has_arg` field of `option`.
+int option_has_arg(int val) {
+  if (val > 0)
+    return flag_at(val).requires_argument() ? required_argument
+                                                : optional_argument;
+  for (const auto& builtin : kBuiltinOptions) {
+    if (builtin.val == val) return builtin.has_arg;
+  }
+  return no_argument;
+}
+
+// Resolves an option name the way `getopt_long_only` does: an exact match
+// wins, otherwise the name may be an unambiguous prefix of a single option.
+// Returns a flag position, the value of a built-in option, `kAmbiguousOption`,
+// or 0 if nothing matched.  Built-in options are only considered if
+// `builtins` is true.
+int find_option(const char* name, size_t length, bool builtins) {
+  if (const auto val = find_flag(name, length)) return val;
+  for (const auto& builtin : kBuiltinOptions) {
+    if (builtins && name_equals(builtin.name, name, length))
+      return builtin.val;
+  }
+
+  // Only unrecognized names reach this point, so the linear scan for
+  // abbreviations stays off the common path.
+  int match = 0;
+  for (int val = 1; val <= flag_count(); ++val) {
+    if (0 != std::strncmp(flag_at(val).name(), name, length)) continue;
+    if (match != 0) return kAmbiguousOption;
+    match = val;
+  }
+  for (const auto& builtin : kBuiltinOptions) {
+    if (!builtins || 0 != std::strncmp(builtin.name, name, length)) continue;
+    if (match != 0) return kAmbiguousOption;
+    match = builtin.val;
+  }
+
+  return match;
+}
+
+// Why `match_option` rejected an option.
+enum class OptionError {
+  kNone,
+  kUnrecognized,
+  kAmbiguous,
+  kUnexpectedArgument,
+  kMissingArgument,
+};
+
+// A command line option, split into its parts by `match_option`.
+struct OptionMatch {
+  // "-" or "--".
+  const char* prefix;
+
+  const char* name;
+  size_t name_length;
 
-    if (column > 0) std::cout.put('\n');
+  // The option, as returned by `find_option`.
+  int val;
+
+  // The value, or nullptr if none was given.
+  const char* value;
+
+  // The number of arguments used by the option, 1 or 2.
+  int consumed;
+};
+
+// Matches the option in `argv[i]`, which starts with '-' and is neither "-"
+// nor "--", the way `getopt_long_only` does.  A required value missing after
+// '=' is taken from the next argument.  Used by both `parse` and `FlagSet`,
+// so this must not touch any global state; `FlagSet` passes false for
+// `builtins`.
+OptionError match_option(int argc, const char* const* argv, int i,
+                         bool builtins, OptionMatch& match) {
+  const char* arg = argv[i];
+  match.prefix = (arg[1] == '-') ? "--" : "-";
+  match.name = arg + std::char_traits<char>::length(match.prefix);
+  match.value = std::strchr(match.name, '=');
+  match.name_length =
+      match.value ? match.value - match.name : std::strlen(match.name);
+  if (match.value) ++match.value;
+  match.consumed = 1;
+
+  match.val = find_option(match.name, match.name_length, builtins);
+  if (match.val == 0) return OptionError::kUnrecognized;
+  if (match.val == kAmbiguousOption) return OptionError::kAmbiguous;
+
+  const int has_arg = option_has_arg(match.val);
+  if (match.value && has_arg == no_argument)
+    return OptionError::kUnexpectedArgument;
+  if (!match.value && has_arg == required_argument) {
+    if (i + 1 == argc) return OptionError::kMissingArgument;
+    match.value = argv[i + 1];
+    match.consumed = 2;
+  }
+
+  return OptionError::kNone;
+}
+
+// Describes an error returned by `match_option` for `arg` in the same words
+// as GNU getopt, listing the possible expansions of ambiguous abbreviations.
+// Built-in options are only listed if `builtins` is true.
+std::string describe_option_error(OptionError error, const char* arg,
+                                  bool builtins, const OptionMatch& match) {
+  std::string result;
+  switch (error) {
+    case OptionError::kNone:
+      break;
+
+    case OptionError::kUnrecognized:
+      result = "unrecognized option '";
+      result += arg;
+      result += '\'';
+      break;
+
+    case OptionError::kAmbiguous:
+      result = "option '";
+      result += arg;
+      result += "' is ambiguous; possibilities:";
+      for (int val = 1; val <= flag_count(); ++val) {
+        if (0 == std::strncmp(flag_at(val).name(), match.name,
+                              match.name_length)) {
+          result += " '";
+          result += match.prefix;
+          result += flag_at(val).name();
+          result += '\'';
+        }
+      }
+      for (const auto& builtin : kBuiltinOptions) {
+        if (builtins &&
+            0 == std::strncmp(builtin.name, match.name, match.name_length)) {
+          result += " '";
+          result += match.prefix;
+          result += builtin.name;
+          result += '\'';
+        }
+      }
+      break;
+
+    case OptionError::kUnexpectedArgument:
+    case OptionError::kMissingArgument:
+      result = "option '";
+      result += match.prefix;
+      result += option_name(match.val);
+      result += (error == OptionError::kMissingArgument)
+                    ? "' requires an argument"
+                    : "' doesn't allow an argument";
+      break;
+  }
+  return result;
+}
+
+void parse_flagfile(const char* path, ParseState& state,
+                    const FlagfileFrame* parent);
+
+// Layout of files written by `save_snapshot`.  The header is followed by
+// `count` entries, each holding a `SnapshotEntry`, the flag's name, file and
+// type name, and its payload.  Strings are not NUL-terminated, and the
+// strings and the payload are each padded to a multiple of 8 bytes.
+const char kSnapshotMagic[8] = {'X', 'F', 'L', 'G', 'S', 'N', 'P', '1'};
+const uint32_t kSnapshotByteOrder = 0x01020304;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t count;
+};
+
+struct SnapshotEntry {
+  uint32_t name_size;
+  uint32_t file_size;
+  uint32_t type_size;
+  uint32_t reserved;
+  uint64_t payload_size;
+};
+
+size_t snapshot_padding(size_t size) { return -size & 7; }
+
+// Returns the position of the flag called `name` declared in `file`, or 0 if
+// there is no such flag.
+int find_snapshot_flag(const char* name, size_t name_size, const char* file,
+                       size_t file_size) {
+  const auto matches = [&](int val) {
+    const char* flag_file = flag_at(val).file();
+    return name_equals(flag_file, file, file_size);
+  };
+
+  const auto val = find_flag(name, name_size);
+  if (val == 0 || matches(val)) return val;
+
+  // Flags with the same name in different files aren't in the hash table.
+  for (int other = 1; other <= flag_count(); ++other) {
+    if (name_equals(flag_at(other).name(), name, name_size) &&
+        matches(other))
+      return other;
+  }
+  return 0;
+}
+
+// Restores the flags saved in the snapshot in `fd`, called `path` in error
+// messages.  If `set_flags` is not empty, the entries of the restored flags
+// are set to true.  If `shared_only` is true, only `Shared` flags are
+// restored.
+bool restore_snapshot(int fd, const char* path, std::vector<bool>& set_flags,
+                      bool shared_only = false) {
+  struct stat st;
+  if (-1 == fstat(fd, &st)) {
+    error_handler(EX_IOERR, "Could not stat flag snapshot '%s': %s", path,
+                  std::strerror(errno));
+    return false;
+  }
+
+  // The mapping is shared, so that `Shared` flags of all processes using
+  // the same file share physical pages.
+  const size_t size = st.st_size;
+  void* map = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0)
+                   : MAP_FAILED;
+
+  SnapshotHeader header;
+  if (size < sizeof(header)) {
+    if (map != MAP_FAILED) munmap(map, size);
+    error_handler(EX_DATAERR, "%s: Not a flag snapshot", path);
+    return false;
+  }
+  if (map == MAP_FAILED) {
+    error_handler(EX_IOERR, "Could not map flag snapshot '%s': %s", path,
+                  std::strerror(errno));
+    return false;
+  }
+
+  const auto data = static_cast<const char*>(map);
+  std::memcpy(&header, data, sizeof(header));
+
+  bool ok = true;
+  if (0 != std::memcmp(header.magic, kSnapshotMagic, sizeof(header.magic))) {
+    error_handler(EX_DATAERR, "%s: Not a flag snapshot", path);
+    ok = false;
+    header.count = 0;
+  } else if (header.byte_order != kSnapshotByteOrder) {
+    error_handler(EX_DATAERR, "%s: Byte order differs from that of this host",
+                  path);
+    ok = false;
+    header.count = 0;
+  }
+
+  // Mismatched entries are skipped, so that all of them are reported.
+  bool keep_mapping = false;
+  size_t offset = sizeof(header);
+  for (uint32_t i = 0; i < header.count; ++i) {
+    SnapshotEntry entry;
+    if (size - offset < sizeof(entry)) {
+      error_handler(EX_DATAERR, "%s: Entry %u is truncated", path, i);
+      ok = false;
+      break;
+    }
+    std::memcpy(&entry, data + offset, sizeof(entry));
+    offset += sizeof(entry);
+
+    const uint64_t strings_size =
+        uint64_t(entry.name_size) + entry.file_size + entry.type_size;
+    const uint64_t payload_offset =
+        strings_size + snapshot_padding(strings_size);
+    if (size - offset < payload_offset ||
+        size - offset - payload_offset < entry.payload_size) {
+      error_handler(EX_DATAERR, "%s: Entry %u is truncated", path, i);
+      ok = false;
+      break;
+    }
+
+    const char* name = data + offset;
+    const char* file = name + entry.name_size;
+    const char* type = file + entry.file_size;
+    if (std::memchr(name, '\0', strings_size)) {
+      error_handler(EX_DATAERR, "%s: Entry %u is corrupt", path, i);
+      ok = false;
+      break;
+    }
+    const char* payload = data + offset + payload_offset;
+    offset += payload_offset + entry.payload_size +
+              snapshot_padding(entry.payload_size);
+    if (offset > size) offset = size;
+
+    const int val =
+        find_snapshot_flag(name, entry.name_size, file, entry.file_size);
+    if (val == 0) {
+      error_handler(EX_DATAERR, "%s: No flag '%.*s' in %.*s", path,
+                    int(entry.name_size), name, int(entry.file_size), file);
+      ok = false;
+      continue;
+    }
+
+    const FlagInfo& info = flag_at(val);
+    if (shared_only && !info.shared()) continue;
+
+    const auto binding = info.bind();
+    const char* flag_type = binding.type();
+    if (!name_equals(flag_type, type, entry.type_size)) {
+      error_handler(EX_DATAERR, "%s: Flag '%s' has type %s, not %.*s", path,
+                    info.name(), flag_type, int(entry.type_size), type);
+      ok = false;
+      continue;
+    }
+
+    if (!binding.load) {
+      error_handler(EX_DATAERR, "%s: Flag '%s' can't be restored from "
+                    "snapshots", path, info.name());
+      ok = false;
+      continue;
+    }
+
+    if (!binding.load(binding.data, payload, entry.payload_size)) {
+      error_handler(EX_DATAERR, "%s: Corrupt value for flag '%s'", path,
+                    info.name());
+      ok = false;
+      continue;
+    }
+
+    if (!set_flags.empty()) set_flags[val] = true;
+    if (info.shared()) keep_mapping = true;
+  }
+
+  // `Shared` flags may point into the mapping from now on, so it's never
+  // unmapped in that case.
+  if (!keep_mapping) munmap(map, size);
+  return ok;
+}
+
+bool restore_snapshot(const char* path, std::vector<bool>& set_flags) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    error_handler(EX_NOINPUT, "Could not open flag snapshot '%s': %s", path,
+                  std::strerror(errno));
+    return false;
+  }
+
+  const bool ok = restore_snapshot(fd, path, set_flags);
+  close(fd);
+  return ok;
+}
+
+// Starts recording `profile`.
+void start_profile(ProfileState& profile) {
+  profile.flags.resize(flag_count() + 1);
+  profile.start_ns = now_ns();
+}
+
+// Acts on an option returned by `find_option`.
+void apply_option(int val, const char* value, ParseState& state,
+                  const FlagfileFrame* frame) {
+  switch (val) {
+    case kHelpOption:
+      if (state.reloading) break;
+      if (value && 0 != std::strcmp(value, "json")) {
+        state.report(EX_USAGE, "Invalid value --help=%s", value);
+        break;
+      }
+      state.print_help = true;
+      state.help_format = value;
+      break;
+
+    case kFlagfileOption:
+      parse_flagfile(value, state, frame);
+      break;
+
+    case kValidateAllOption:
+      state.validate_all = true;
+      break;
+
+    case kSnapshotOption:
+      if (!state.reloading) restore_snapshot(value, state.set_flags);
+      break;
+
+    case kProfileOption:
+      if (!state.profile && state.profile_storage) {
+        state.profile = state.profile_storage;
+        state.profile->print_json = true;
+        start_profile(*state.profile);
+      }
+      break;
+
+    default:
+      if (!state.reloading || flag_at(val).reloadable())
+        parse_flag(val, value, state.report, state.profile);
+      if (!state.set_flags.empty()) state.set_flags[val] = true;
+  }
+}
+
+// Maps the file at `path` privately, so that line breaks can be overwritten
+// with NUL bytes without copying any lines.  The returned buffer is followed
+// by at least one NUL byte.  It is only unmapped by `reclaim()`, after a
+// reload, so flag values parsed from it may keep pointing into it.
+char* map_flagfile(int fd, size_t size) {
+  // Reserve room for the terminating NUL first, then map the file on top.
+  // If the file size is a multiple of the page size, the NUL ends up in the
+  // anonymous page following it.
+  auto data = static_cast<char*>(mmap(nullptr, size + 1,
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (data == MAP_FAILED) return nullptr;
+
+  if (size > 0 && MAP_FAILED == mmap(data, size, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_FIXED, fd, 0)) {
+    munmap(data, size + 1);
+    return nullptr;
+  }
+
+  return data;
+}
+
+// Parses a file containing one flag per line, in the form `--name=value`.
+// The leading dashes are optional, blank lines and lines starting with `#`
+// are ignored, and trailing white space is removed.
+void parse_flagfile(const char* path, ParseState& state,
+                    const FlagfileFrame* parent) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    state.report(EX_NOINPUT, "Could not open flag file '%s': %s", path,
+                 std::strerror(errno));
+    return;
+  }
+
+  struct stat st;
+  if (-1 == fstat(fd, &st)) {
+    state.report(EX_IOERR, "Could not stat flag file '%s': %s", path,
+                 std::strerror(errno));
+    close(fd);
+    return;
+  }
+
+  for (auto frame = parent; frame; frame = frame->parent) {
+    if (frame->device == st.st_dev && frame->inode == st.st_ino) {
+      state.report(EX_DATAERR, "Flag file '%s' includes itself", path);
+      close(fd);
+      return;
+    }
+  }
+  const FlagfileFrame frame{st.st_dev, st.st_ino, parent};
+
+  const size_t size = st.st_size;
+  char* data = map_flagfile(fd, size);
+  close(fd);
+  if (!data) {
+    state.report(EX_IOERR, "Failed to memory-map flag file '%s': %s", path,
+                 std::strerror(errno));
+    return;
+  }
+
+  const char* data_end = data + size;
+  size_t line_number = 0;
+
+  for (char* line = data; line < data_end;) {
+    ++line_number;
+
+    auto line_end =
+        static_cast<char*>(std::memchr(line, '\n', data_end - line));
+    if (!line_end) line_end = data + size;
+    char* next_line = line_end + 1;
+
+    while (line != line_end && std::isspace(static_cast<unsigned char>(*line)))
+      ++line;
+    while (line_end != line &&
+           std::isspace(static_cast<unsigned char>(line_end[-1])))
+      --line_end;
+    *line_end = '\0';
+
+    if (line == line_end || *line == '#') {
+      line = next_line;
+      continue;
+    }
+
+    const char* name = line;
+    if (*name == '-') ++name;
+    if (*name == '-') ++name;
+    char* value = std::strchr(line, '=');
+    const size_t name_length = value ? value - name : line_end - name;
+    if (value) ++value;
+
+    const auto match_start = state.profile ? now_ns() : 0;
+    const auto val = find_option(name, name_length, true);
+    if (state.profile)
+      state.profile->profile.match_ns += now_ns() - match_start;
+    if (val == 0) {
+      state.report(EX_USAGE, "%s:%zu: Unrecognized option '%s'", path,
+                   line_number, line);
+    } else if (val == kAmbiguousOption) {
+      state.report(EX_USAGE, "%s:%zu: Option '%s' is ambiguous", path,
+                   line_number, line);
+    } else if (value && option_has_arg(val) == no_argument) {
+      state.report(EX_USAGE, "%s:%zu: Option '--%s' doesn't allow an argument",
+                   path, line_number, option_name(val));
+    } else if (!value && option_has_arg(val) == required_argument) {
+      state.report(EX_USAGE, "%s:%zu: Option '--%s' requires an argument",
+                   path, line_number, option_name(val));
+    } else {
+      apply_option(val, value, state, &frame);
+    }
+
+    line = next_line;
+  }
+
+  if (state.reloading) {
+    struct Mapping {
+      void* data;
+      size_t size;
+    };
+    retire(new Mapping{data, size + 1}, [](const void* ptr) {
+      auto mapping = static_cast<const Mapping*>(ptr);
+      munmap(mapping->data, mapping->size);
+      delete mapping;
+    });
+  }
+}
+
+// The buffer `std::cout` writes to unless redirected by the program.
+std::streambuf* const stdout_buffer = std::cout.rdbuf();
+
+// Writes `text` to standard output.  Unless `std::cout` has been redirected,
+// this flushes it and stdio, then writes all of `text` with one write(2).
+void write_output(const std::string& text) {
+  if (std::cout.rdbuf() != stdout_buffer) {
+    std::cout.write(text.data(), text.size());
+    return;
+  }
+
+  std::cout.flush();
+  std::fflush(stdout);
+
+  const char* data = text.data();
+  size_t remaining = text.size();
+  while (remaining > 0) {
+    const auto result = write(STDOUT_FILENO, data, remaining);
+    if (result == -1) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    data += result;
+    remaining -= result;
+  }
+}
+
+// Returns the width help text is wrapped to.
+uint16_t terminal_columns() {
+  uint16_t column_count = 80;
+
+  winsize ws;
+  if (0 == ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_col > 0) {
+    column_count = ws.ws_col;
+    if (column_count > 100) column_count = 100;
+  }
+
+  return column_count;
+}
+
+// Appends the help text for all flags, wrapped to `column_count` columns, to
+// `out`.
+void render_help(uint16_t column_count, std::string& out) {
+  const char* file = nullptr;
+  const bool multiple_files = flag_at(1).file() != flag_at(flag_count()).file();
+
+  for (int val = 1; val <= flag_count(); ++val) {
+    const FlagInfo& info = flag_at(val);
+
+    if (info.file() != file && multiple_files) {
+      if (file != nullptr) out += '\n';
+      out += "Options in ";
+      out += info.file();
+      out += ":\n";
+      file = info.file();
+    }
+    const auto name_length = std::char_traits<char>::length(info.name());
+
+    out += "      --";
+    out.append(info.name(), name_length);
+
+    size_t column = name_length + 8;
+
+    if (info.placeholder()) {
+      const auto placeholder_length =
+          std::char_traits<char>::length(info.placeholder());
+      out += '=';
+      out.append(info.placeholder(), placeholder_length);
+
+      column += placeholder_length + 1;
+    }
+
+    if (column >= 28) {
+      out += '\n';
+      column = 0;
+    }
+
+    const char* range_begin = info.description();
+    size_t description_column = 29;
+
+    while (*range_begin) {
+      if (column < description_column) {
+        out.append(description_column - column, ' ');
+        column = description_column;
+      }
+
+      const char* range_end = range_begin;
+
+      // We put at least one word per line, regardless of length.
+      while (*range_end && *range_end != ' ') ++range_end;
+
+      // Try to fit more words on the line.
+      for (const char* c = range_end; c - range_begin + column < column_count;
+           ++c) {
+        if (*c == '\0' || is_space(*c)) {
+          range_end = c;
+          if (*c == '\0' || *c == '\n') break;
+        }
+      }
+
+      out.append(range_begin, range_end - range_begin);
+      out += '\n';
+      column = 0;
+
+      while (*range_end != '\0' && is_space(*range_end)) ++range_end;
+
+      range_begin = range_end;
+      description_column = 31;
+    }
+
+    if (column > 0) out += '\n';
+  }
+
+  if (multiple_files) out += '\n';
+}
+
+// Returns the help text for all flags wrapped to `column_count` columns.
+// The text is rendered once per column count.
+const std::string& help_text(uint16_t column_count) {
+  static std::string text;
+  static uint16_t text_column_count = 0;
+  static int text_flag_count = 0;
+
+  if (text_column_count != column_count || text_flag_count != flag_count()) {
+    text.clear();
+    if (flag_count() > 0) render_help(column_count, text);
+    text_column_count = column_count;
+    text_flag_count = flag_count();
+  }
+
+  return text;
+}
+
+// Appends `string` to `out` as a JSON string, or `null` if it's nullptr.
+void append_json_string(const char* string, std::string& out) {
+  if (!string) {
+    out += "null";
+    return;
+  }
+
+  out += '"';
+  for (; *string; ++string) {
+    const auto ch = static_cast<unsigned char>(*string);
+    switch (ch) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (ch < 0x20) {
+          char escape[8];
+          std::snprintf(escape, sizeof(escape), "\\u%04x", ch);
+          out += escape;
+        } else {
+          out += *string;
+        }
+    }
+  }
+  out += '"';
+}
+
+// Returns the output of `--help=json`.
+std::string help_json() {
+  std::string out = "[";
+
+  for (int val = 1; val <= flag_count(); ++val) {
+    const FlagInfo& info = flag_at(val);
+
+    out += (val == 1) ? "\n  {\"name\": " : ",\n  {\"name\": ";
+    append_json_string(info.name(), out);
+    out += ", \"placeholder\": ";
+    append_json_string(info.placeholder(), out);
+    out += ", \"type\": ";
+    append_json_string(info.bind().type(), out);
+    out += ", \"file\": ";
+    append_json_string(info.file(), out);
+    out += ", \"description\": ";
+    append_json_string(info.description(), out);
+    out += ", \"requires_argument\": ";
+    out += info.requires_argument() ? "true" : "false";
+    out += ", \"reloadable\": ";
+    out += info.reloadable() ? "true" : "false";
+    out += '}';
+  }
+
+  out += (flag_count() > 0) ? "\n]\n" : "]\n";
+  return out;
+}
+
+// Sets flags from the environment variables named `environment_prefix`
+// followed by the flag name in any case, unless they were set already.
+void parse_environment(ParseState& state) {
+  const auto prefix_length =
+      std::char_traits<char>::length(environment_prefix);
+
+  // Longer names can't match any flag.
+  char name[256];
+
+  for (char** entry = environ; *entry; ++entry) {
+    const char* variable = *entry;
+    if (0 != std::strncmp(variable, environment_prefix, prefix_length))
+      continue;
+
+    const char* value = std::strchr(variable + prefix_length, '=');
+    if (!value) continue;
+
+    const size_t name_length = value - variable - prefix_length;
+    if (name_length >= sizeof(name)) continue;
+
+    for (size_t i = 0; i < name_length; ++i) {
+      const char ch = variable[prefix_length + i];
+      name[i] = (ch >= 'A' && ch <= 'Z') ? ch - 'A' + 'a' : ch;
+    }
+
+    const auto val = find_flag(name, name_length);
+    if (val == 0 || state.set_flags[val]) continue;
+
+    apply_option(val, value + 1, state, nullptr);
+  }
+}
+
+// Appends `profile` to `out` as a JSON object.
+void append_json_profile(const FlagProfile& profile, std::string& out) {
+  out += '{';
+  if (profile.flag) {
+    out += "\"name\": ";
+    append_json_string(profile.flag->name(), out);
+    out += ", ";
+  }
+  out += "\"type\": ";
+  append_json_string(profile.type, out);
+  out += ", \"calls\": " + std::to_string(profile.calls);
+  out += ", \"ns\": " + std::to_string(profile.ns);
+  out += ", \"heap_bytes\": " + std::to_string(profile.heap_bytes);
+  out += '}';
+}
+
+// Stops recording `state`, and reports the result.
+void finish_profile(ProfileState& state) {
+  auto& profile = state.profile;
+  profile.total_ns = now_ns() - state.start_ns;
+
+  for (const auto& flag : state.flags) {
+    if (!flag.calls) continue;
+    profile.flags.emplace_back(flag);
+    profile.parse_ns += flag.ns;
+    profile.heap_bytes += flag.heap_bytes;
+
+    auto type = std::find_if(
+        profile.types.begin(), profile.types.end(),
+        [&flag](const FlagProfile& type) {
+          return 0 == std::strcmp(type.type, flag.type);
+        });
+    if (type == profile.types.end())
+      type = profile.types.insert(type,
+                                  FlagProfile{nullptr, flag.type, 0, 0, 0});
+    type->calls += flag.calls;
+    type->ns += flag.ns;
+    type->heap_bytes += flag.heap_bytes;
+  }
+
+  if (profile_handler) profile_handler(profile);
+
+  if (!state.print_json) return;
+
+  std::string out = "{\"total_ns\": " + std::to_string(profile.total_ns);
+  out += ", \"match_ns\": " + std::to_string(profile.match_ns);
+  out += ", \"parse_ns\": " + std::to_string(profile.parse_ns);
+  out += ", \"environment_ns\": " + std::to_string(profile.environment_ns);
+  out += ", \"help_ns\": " + std::to_string(profile.help_ns);
+  out += ", \"heap_bytes\": " + std::to_string(profile.heap_bytes);
+  out += ",\n \"flags\": [";
+  for (const auto& flag : profile.flags) {
+    out += (&flag == &profile.flags.front()) ? "\n  " : ",\n  ";
+    append_json_profile(flag, out);
+  }
+  out += "],\n \"types\": [";
+  for (const auto& type : profile.types) {
+    out += (&type == &profile.types.front()) ? "\n  " : ",\n  ";
+    append_json_profile(type, out);
+  }
+  out += "]}\n";
+
+  std::fwrite(out.data(), 1, out.size(), stderr);
+}
+
+}  // namespace
+
+void parse(int argc, char** argv) {
+  if (argc == 0) return;
+
+  register_loaded_flags();
+
+  ParseState state;
+  const bool posixly_correct = getenv("POSIXLY_CORRECT") != nullptr;
+  if (environment_prefix) state.set_flags.resize(flag_count() + 1);
+
+  ProfileState profile;
+  state.profile_storage = &profile;
+  for (int i = 1; i < argc && 0 != std::strcmp(argv[i], "--"); ++i) {
+    if (0 == std::strcmp(argv[i], "--xflags_profile") ||
+        0 == std::strcmp(argv[i], "-xflags_profile"))
+      profile.print_json = true;
+  }
+  if (profile.print_json || profile_handler) {
+    state.profile = &profile;
+    start_profile(profile);
+  }
+
+  // Non-option arguments are moved behind the options, like GNU getopt does,
+  // so that `optind` points at the first of them when we're done.  The
+  // arguments in [first_nonopt, i) are the non-options skipped so far.
+  int first_nonopt = 1;
+  int i = 1;
+
+  while (i < argc) {
+    const char* arg = argv[i];
+
+    if (arg[0] != '-' || arg[1] == '\0') {
+      if (posixly_correct) break;
+      ++i;
+      continue;
+    }
+
+    if (0 == std::strcmp(arg, "--")) {
+      std::rotate(argv + first_nonopt, argv + i, argv + i + 1);
+      ++first_nonopt;
+      break;
+    }
+
+    OptionMatch match;
+    const auto match_start = state.profile ? now_ns() : 0;
+    const auto status = match_option(argc, argv, i, true, match);
+    if (state.profile)
+      state.profile->profile.match_ns += now_ns() - match_start;
+
+    if (status == OptionError::kNone) {
+      apply_option(match.val, match.value, state, nullptr);
+
+      std::rotate(argv + first_nonopt, argv + i, argv + i + match.consumed);
+      first_nonopt += match.consumed;
+      i += match.consumed;
+
+      // `getopt_long_only` stopped at `--help`, so we do too.
+      if (state.print_help) break;
+      continue;
+    }
+
+    std::fprintf(stderr, "%s: %s\n", argv[0],
+                 describe_option_error(status, arg, true, match).c_str());
+    error_handler(EX_USAGE, "Try '%s --help' for more information.", argv[0]);
+    return;
+  }
+
+  optind = first_nonopt;
+
+  if (environment_prefix && !state.print_help) {
+    const auto environment_start = state.profile ? now_ns() : 0;
+    parse_environment(state);
+    if (state.profile)
+      profile.profile.environment_ns = now_ns() - environment_start;
+  }
+
+  ReloadableBase::publish_staged();
+
+  if (state.validate_all && !state.print_help) LazyBase::parse_all();
+
+  if (state.print_help) {
+    const auto help_start = state.profile ? now_ns() : 0;
+    std::string text;
+    if (state.help_format) {
+      text = help_json();
+    } else {
+      text = "Usage: ";
+      text += argv[0];
+      text += " [OPTION]...\n\n";
+      text += help_text(terminal_columns());
+      text +=
+          "      --flagfile=FILE        read options from FILE, one per line\n"
+          "      --flagsnapshot=FILE    restore flags saved in FILE\n"
+          "      --help[=json]          display this help and exit\n"
+          "      --xflags_profile       print startup timing as JSON to "
+          "stderr\n"
+          "      --xflags_validate_all  parse values of lazy flags right away\n";
+    }
+    if (state.profile) {
+      profile.profile.help_ns = now_ns() - help_start;
+      finish_profile(profile);
+    }
+    write_output(text);
+    std::exit(EXIT_SUCCESS);
+  }
+
+  if (state.profile) finish_profile(profile);
+}
+
+namespace {
+
+// Values in `FlagValues` are searched linearly up to this count, and through
+// `index_` above it.
+const size_t kLinearSearchLimit = 16;
+
+// The size of the blocks `FlagValues` stores values in, in units of
+// `std::max_align_t`.
+const size_t kBlockUnits = 256;
+
+// The positions of the flags at positions 1 to `count`, sorted by the address
+// of their variables.
+struct FlagPositions {
+  std::vector<std::pair<const void*, int>> entries;
+  int count;
+};
+
+// The current positions.  Replaced by `update_flag_positions`, and never
+// modified once published, like `flag_index`.
+std::atomic<const FlagPositions*> flag_positions{nullptr};
+
+bool address_less(const std::pair<const void*, int>& lhs,
+                  const std::pair<const void*, int>& rhs) {
+  return std::less<const void*>()(lhs.first, rhs.first);
+}
+
+// Publishes positions including the flags registered since the current ones
+// were sorted, merging them into a copy of the sorted entries.
+void update_flag_positions() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+
+  const auto old_positions = flag_positions.load(std::memory_order_relaxed);
+  const auto count = flag_count();
+  if (old_positions && old_positions->count == count) return;
+
+  std::unique_ptr<FlagPositions> positions(new FlagPositions);
+  auto& entries = positions->entries;
+  entries.reserve(count);
+  int first = 0;
+  if (old_positions) {
+    entries = old_positions->entries;
+    first = old_positions->count;
+  }
+
+  const auto middle = entries.size();
+  for (int val = first + 1; val <= count; ++val)
+    entries.emplace_back(flag_at(val).bind().data, val);
+  std::sort(entries.begin() + middle, entries.end(), address_less);
+  std::inplace_merge(entries.begin(), entries.begin() + middle, entries.end(),
+                     address_less);
+  positions->count = count;
+
+  flag_positions.store(positions.release(), std::memory_order_release);
+  if (old_positions) {
+    retire(old_positions, [](const void* ptr) {
+      delete static_cast<const FlagPositions*>(ptr);
+    });
+  }
+}
+
+// Returns the position of the flag whose variable is at `data`, or 0 if there
+// is no such flag.
+int flag_position(const void* data) {
+  auto positions = flag_positions.load(std::memory_order_acquire);
+  if (!positions || positions->count != flag_count()) {
+    update_flag_positions();
+    positions = flag_positions.load(std::memory_order_acquire);
+  }
+
+  const auto& entries = positions->entries;
+  const auto position = std::lower_bound(
+      entries.begin(), entries.end(), std::make_pair(data, 0), address_less);
+  return (position != entries.end() && position->first == data)
+             ? position->second
+             : 0;
+}
+
+}  // namespace
+
+FlagValues::FlagValues(FlagValues&& other) noexcept {
+  *this = std::move(other);
+}
+
+FlagValues& FlagValues::operator=(FlagValues&& other) noexcept {
+  if (this != &other) {
+    clear();
+    values_.swap(other.values_);
+    arguments_.swap(other.arguments_);
+    blocks_.swap(other.blocks_);
+    std::swap(block_, other.block_);
+    std::swap(block_used_, other.block_used_);
+    index_.swap(other.index_);
+  }
+  return *this;
+}
+
+FlagValues::~FlagValues() { clear(); }
+
+void FlagValues::clear() {
+  for (const auto& value : values_) value.destroy(value.data);
+  values_.clear();
+  arguments_.clear();
+  block_ = 0;
+  block_used_ = 0;
+}
+
+const void* FlagValues::find(const void* flag) const {
+  if (values_.size() <= kLinearSearchLimit) {
+    for (const auto& value : values_) {
+      if (value.flag == flag) return value.data;
+    }
+    return nullptr;
+  }
+
+  const auto val = flag_position(flag);
+  // Flags registered after the last `parse` are past the end of `index_`.
+  if (val == 0 || static_cast<size_t>(val) >= index_.size()) return nullptr;
+  const auto position = index_[val];
+  return (position < values_.size() && values_[position].val == val)
+             ? values_[position].data
+             : nullptr;
+}
+
+void* FlagValues::allocate(size_t size) {
+  const auto units =
+      (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+  while (block_ < blocks_.size() &&
+         block_used_ + units > blocks_[block_].size) {
+    ++block_;
+    block_used_ = 0;
+  }
+  if (block_ == blocks_.size()) {
+    const auto block_size = std::max(units, kBlockUnits);
+    blocks_.emplace_back(Block{
+        std::unique_ptr<std::max_align_t[]>(new std::max_align_t[block_size]),
+        block_size});
+  }
+
+  void* result = blocks_[block_].data.get() + block_used_;
+  block_used_ += units;
+  return result;
+}
+
+bool FlagSet::parse(int argc, const char* const* argv, FlagValues& values,
+                    std::string& error) const {
+  values.clear();
+
+  auto fail = [&](std::string message) {
+    values.clear();
+    error = std::move(message);
+    return false;
+  };
+
+  for (int i = 1; i < argc;) {
+    const char* arg = argv[i];
+
+    if (arg[0] != '-' || arg[1] == '\0') {
+      values.arguments_.emplace_back(arg);
+      ++i;
+      continue;
+    }
+
+    if (0 == std::strcmp(arg, "--")) {
+      values.arguments_.insert(values.arguments_.end(), argv + i + 1,
+                               argv + argc);
+      break;
+    }
+
+    OptionMatch match;
+    // The built-in options of `parse` act on global state, so they aren't
+    // matched.
+    const auto status = match_option(argc, argv, i, false, match);
+    if (status != OptionError::kNone)
+      return fail(describe_option_error(status, arg, false, match));
+    i += match.consumed;
+
+    const auto val = match.val;
+    const FlagInfo& info = flag_at(val);
+
+    // Find the value of the flag, in case it's given more than once.
+    const FlagValues::Value* value = nullptr;
+    if (values.values_.size() <= kLinearSearchLimit) {
+      for (const auto& candidate : values.values_) {
+        if (candidate.val == val) value = &candidate;
+      }
+    } else if (static_cast<size_t>(val) < values.index_.size()) {
+      const auto position = values.index_[val];
+      if (position < values.values_.size() &&
+          values.values_[position].val == val)
+        value = &values.values_[position];
+    }
+
+    // Otherwise, start from a copy of the exported variable, so that list
+    // flags append to their defaults like they do in `parse`.
+    if (!value) {
+      const auto binding = info.bind();
+      if (!binding.copy)
+        return fail(std::string("Flag --") + info.name() +
+                    " can't be stored in FlagValues");
+
+      void* data = values.allocate(binding.size);
+      binding.copy(data, binding.data);
+      values.values_.emplace_back(FlagValues::Value{
+          binding.data, data, binding.parse, binding.destroy, val});
+      value = &values.values_.back();
+
+      auto& index = values.index_;
+      if (values.values_.size() > kLinearSearchLimit) {
+        // Flags may have been registered since `index` was sized.
+        const auto index_size = static_cast<size_t>(flag_count()) + 1;
+        if (index.size() < index_size) index.resize(index_size);
+        if (values.values_.size() == kLinearSearchLimit + 1) {
+          for (size_t j = 0; j < values.values_.size(); ++j)
+            index[values.values_[j].val] = j;
+        } else {
+          index[val] = values.values_.size() - 1;
+        }
+      }
+    }
+
+    const char* endptr = nullptr;
+    if (!value->parse(value->data, match.value, &endptr)) {
+      return fail(std::string("Invalid value --") + info.name() + "=" +
+                  string_or_empty(match.value));
+    }
+    if (*endptr != '\0') {
+      return fail(std::string("Garbage in value --") + info.name() + "=" +
+                  string_or_empty(match.value) + ": " + endptr);
+    }
+  }
+
+  return true;
+}
+
+namespace {
+
+// Returns the contents of a snapshot of the current flag values.
+std::string build_snapshot() {
+  SnapshotHeader header;
+  std::memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+  header.byte_order = kSnapshotByteOrder;
+  header.count = 0;
+
+  std::string out(sizeof(header), '\0');
+  for (int val = 1; val <= flag_count(); ++val) {
+    const FlagInfo& info = flag_at(val);
+    const auto binding = info.bind();
+    if (!binding.save) continue;
+
+    const char* type = binding.type();
+    SnapshotEntry entry;
+    entry.name_size = std::strlen(info.name());
+    entry.file_size = std::strlen(info.file());
+    entry.type_size = std::strlen(type);
+    entry.reserved = 0;
+
+    const auto entry_offset = out.size();
+    out.append(sizeof(entry), '\0');
+    out.append(info.name(), entry.name_size);
+    out.append(info.file(), entry.file_size);
+    out.append(type, entry.type_size);
+    out.append(snapshot_padding(out.size()), '\0');
+
+    const auto payload_offset = out.size();
+    binding.save(binding.data, out);
+    entry.payload_size = out.size() - payload_offset;
+    out.append(snapshot_padding(out.size()), '\0');
+
+    std::memcpy(&out[entry_offset], &entry, sizeof(entry));
+    ++header.count;
+  }
+  std::memcpy(&out[0], &header, sizeof(header));
+
+  return out;
+}
+
+// Writes all of `data` to `fd`.  Returns false on failure, with `errno` set.
+bool write_all(int fd, const std::string& data) {
+  const char* ptr = data.data();
+  const char* const data_end = ptr + data.size();
+  while (ptr != data_end) {
+    const auto ret = write(fd, ptr, data_end - ptr);
+    if (ret == -1 && errno == EINTR) continue;
+    if (ret <= 0) return false;
+    ptr += ret;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool save_snapshot(const char* path) {
+  const auto out = build_snapshot();
+
+  // Write to a temporary file first, so that processes starting meanwhile
+  // never see a partial snapshot.
+  std::string temp_path = path;
+  temp_path += ".XXXXXX";
+  const int fd = mkstemp(&temp_path[0]);
+  if (fd == -1) {
+    error_handler(EX_CANTCREAT, "Could not create '%s': %s", temp_path.c_str(),
+                  std::strerror(errno));
+    return false;
+  }
+  // mkstemp creates files only readable by their owner.
+  fchmod(fd, 0644);
+
+  if (!write_all(fd, out) || 0 != close(fd) ||
+      0 != rename(temp_path.c_str(), path)) {
+    error_handler(EX_IOERR, "Could not write flag snapshot '%s': %s", path,
+                  std::strerror(errno));
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool load_snapshot(const char* path) {
+  std::vector<bool> set_flags;
+  return restore_snapshot(path, set_flags);
+}
+
+int publish_shared() {
+  const auto out = build_snapshot();
+
+#ifdef MFD_ALLOW_SEALING
+  const int fd = memfd_create("xflags", MFD_ALLOW_SEALING);
+#else
+  // Without memfd, use an unlinked file in /dev/shm instead.
+  char path[] = "/dev/shm/xflags-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd != -1) unlink(path);
+#endif
+  if (fd == -1) {
+    error_handler(EX_OSERR, "Could not create shared memory: %s",
+                  std::strerror(errno));
+    return -1;
+  }
+
+  if (!write_all(fd, out)) {
+    error_handler(EX_IOERR, "Could not write shared memory: %s",
+                  std::strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+#ifdef MFD_ALLOW_SEALING
+  // Nobody, including this process, can change the values from now on.
+  if (-1 == fcntl(fd, F_ADD_SEALS,
+                  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) {
+    error_handler(EX_OSERR, "Could not seal shared memory: %s",
+                  std::strerror(errno));
+    close(fd);
+    return -1;
+  }
+#endif
+
+  // Point our own `Shared` flags at the region too, releasing their private
+  // copies, so that forked children share the pages from the start.  The
+  // other flags already have the values just written.
+  std::vector<bool> set_flags;
+  if (!restore_snapshot(fd, "shared flags", set_flags, true)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+bool attach_shared(int fd) {
+  std::vector<bool> set_flags;
+  return restore_snapshot(fd, "shared flags", set_flags);
+}
+
+namespace {
+
+// Flags with values staged by the current parse, linked through
+// `next_staged_`.
+ReloadableBase* staged_head;
+
+// Serializes reloads.
+std::mutex reload_mutex;
+
+// The file given to `enable_reload`.
+std::string reload_path;
+
+// Write end of the pipe used to wake the reload thread from the SIGHUP
+// handler.
+int reload_pipe = -1;
+
+// Set by `report_reload_error` if the file being reloaded has errors.
+bool reload_failed;
+
+// Reports errors while reloading, so that errors in the flag file don't
+// terminate a running process.
+void report_reload_error(int, const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vwarnx(fmt, args);
+  va_end(args);
+  reload_failed = true;
+}
+
+void handle_sighup(int) {
+  const int saved_errno = errno;
+  const char byte = 0;
+  if (-1 == write(reload_pipe, &byte, 1)) {
+    // Nothing to do; a reload is already pending if the pipe is full.
+  }
+  errno = saved_errno;
+}
+
+// Waits for SIGHUP, signalled through `signal_fd`, or for changes to the
+// file called `basename` reported by `inotify_fd`, and reloads the file.
+// `inotify_fd` is -1 if changes aren't watched.
+void reload_loop(int signal_fd, int inotify_fd, const std::string& basename) {
+  alignas(inotify_event) char buffer[4096];
+
+  for (;;) {
+    pollfd fds[2] = {{signal_fd, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+    if (-1 == poll(fds, (inotify_fd == -1) ? 1 : 2, -1)) {
+      if (errno == EINTR) continue;
+      warn("Reload thread stopped");
+      return;
+    }
+
+    bool changed = false;
+
+    if (fds[0].revents & POLLIN) {
+      if (read(signal_fd, buffer, sizeof(buffer)) > 0) changed = true;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      const auto length = read(inotify_fd, buffer, sizeof(buffer));
+      for (ssize_t offset = 0; offset < length;) {
+        const auto& event = *reinterpret_cast<inotify_event*>(buffer + offset);
+        if (event.len > 0 && basename == event.name) changed = true;
+        offset += sizeof(inotify_event) + event.len;
+      }
+    }
+
+    if (changed) reload();
+  }
+}
+
+}  // namespace
+
+void ReloadableBase::stage() {
+  next_staged_ = staged_head;
+  staged_head = this;
+}
+
+void ReloadableBase::publish_staged() {
+  while (staged_head) {
+    auto flag = staged_head;
+    staged_head = flag->next_staged_;
+    flag->next_staged_ = nullptr;
+    flag->publish();
+  }
+}
+
+void ReloadableBase::discard_staged() {
+  while (staged_head) {
+    auto flag = staged_head;
+    staged_head = flag->next_staged_;
+    flag->next_staged_ = nullptr;
+    flag->discard();
+  }
+}
+
+void ReloadableBase::retire(const void* value,
+                            void (*deleter)(const void*)) {
+  ::xflags::retire(value, deleter);
+}
+
+void enable_reload(const char* path) {
+  std::lock_guard<std::mutex> lock(reload_mutex);
+  if (reload_pipe != -1) {
+    error_handler(EXIT_FAILURE, "enable_reload called more than once");
+    return;
+  }
+
+  // Relative paths are resolved now, so that they still name the same file
+  // if the program changes its working directory.
+  reload_path = path;
+  if (path[0] != '/') {
+    if (char* cwd = getcwd(nullptr, 0)) {
+      reload_path = std::string(cwd) + '/' + path;
+      free(cwd);
+    }
+  }
+
+  int fds[2];
+  if (-1 == pipe2(fds, O_CLOEXEC | O_NONBLOCK)) {
+    error_handler(EX_OSERR, "Failed to create pipe: %s", std::strerror(errno));
+    return;
+  }
+  reload_pipe = fds[1];
+
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_sighup;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGHUP, &action, nullptr);
+
+  // Watch the directory rather than the file itself, so that replacing the
+  // file with rename(2), as most editors and deployment tools do, is noticed.
+  // The watch is added before returning, so that no change made after this
+  // call is missed.
+  std::string directory = ".", basename = reload_path;
+  const auto slash = reload_path.rfind('/');
+  if (slash != std::string::npos) {
+    directory = reload_path.substr(0, slash + 1);
+    basename = reload_path.substr(slash + 1);
+  }
+
+  int inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (inotify_fd != -1 &&
+      -1 == inotify_add_watch(inotify_fd, directory.c_str(),
+                              IN_CLOSE_WRITE | IN_MOVED_TO)) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+  if (inotify_fd == -1)
+    warn("Not watching '%s' for changes", reload_path.c_str());
+
+  std::thread(reload_loop, fds[0], inotify_fd, std::move(basename)).detach();
+}
+
+bool reload() {
+  std::lock_guard<std::mutex> lock(reload_mutex);
+
+  ParseState state;
+  state.reloading = true;
+  state.report = report_reload_error;
+  reload_failed = false;
+
+  parse_flagfile(reload_path.c_str(), state, nullptr);
+
+  if (reload_failed) {
+    warnx("Not applying '%s' due to errors", reload_path.c_str());
+    ReloadableBase::discard_staged();
+    return false;
+  }
+
+  ReloadableBase::publish_staged();
+  return true;
+}
+
+void reclaim() {
+  std::vector<std::pair<const void*, void (*)(const void*)>> values;
+  {
+    std::lock_guard<std::mutex> lock(retired_mutex);
+    values.swap(retired);
+  }
+  for (const auto& value : values) value.second(value.first);
+}
+
+namespace {
+
+// Lazy flags with recorded values, linked through `next_recorded_`.
+LazyBase* recorded_head;
+
+// Returns the name of the flag exported from `data`.
+const char* flag_name(const void* data) {
+  const auto val = flag_position(data);
+  return val ? flag_at(val).name() : "?";
+}
+
+}  // namespace
+
+void LazyBase::record(const char* value) {
+  if (values_.empty()) {
+    next_recorded_ = recorded_head;
+    recorded_head = this;
+  }
+  values_.emplace_back(value);
+}
+
+void LazyBase::parse_all() {
+  for (auto flag = recorded_head; flag; flag = flag->next_recorded_)
+    flag->parse_now();
+}
+
+void LazyBase::materialize(bool (*parse)(void* target, const char* string,
+                                         const char** endptr),
+                           void* target, const void* flag) const {
+  std::call_once(once_, [&] {
+    for (const auto value : values_) {
+      const char* endptr = nullptr;
+      if (!parse(target, value, &endptr)) {
+        error_handler(EX_USAGE, "Invalid value --%s=%s", flag_name(flag),
+                      value);
+        return;
+      }
+
+      if (*endptr != '\0') {
+        error_handler(EX_USAGE, "Garbage in value --%s=%s: %s",
+                      flag_name(flag), value, endptr);
+        return;
+      }
+    }
+  });
+}
+
+void print_help() { write_output(help_text(terminal_columns())); }
+
+void print_help_json() { write_output(help_json()); }
+
+std::string type_name_from_signature(const char* signature) {
+  // GCC and Clang describe `TypeName<T>::get` as "... [T = type]" or
+  // "... [with T = type]", possibly followed by "; ...".
+  const char* begin = std::strstr(signature, "T = ");
+  if (!begin) return "unknown";
+  begin += 4;
+
+  const char* end = begin;
+  int depth = 0;
+  for (; *end; ++end) {
+    if (*end == '<' || *end == '(' || *end == '[') {
+      ++depth;
+    } else if (*end == '>' || *end == ')') {
+      --depth;
+    } else if (*end == ']' || *end == ';') {
+      if (depth == 0) break;
+      --depth;
+    }
   }
 
-  if (multiple_files) std::cout.put('\n');
+  return std::string(begin, end);
 }
 
 }  // namespace
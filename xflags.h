@@ -1,27 +1,102 @@
 #ifndef XFLAGS_H_
 #define XFLAGS_H_ 1
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <set>
 #include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <getopt.h>
 
 namespace xflags {
 
+struct FlagInfo;
+
 // Pointer to the function the xflags library will use to handle fatal error
 // errors.  It is supposed to never return, although this is not a requirement.
 //
 // By default, this variable points to `errx`.
 extern void (*error_handler)(int eval, const char* fmt, ...);
 
+// If not nullptr, `parse` also sets flags from environment variables named
+// by this prefix followed by the flag name, e.g. "XFLAGS_" for
+// `XFLAGS_WIDTH=80`.  The part after the prefix is matched against flag names
+// after converting it to lower case.  Flags given on the command line or in
+// flag files take precedence.  Defaults to nullptr.
+extern const char* environment_prefix;
+
+// Time spent parsing the values of a flag, or of all flags of a type, and the
+// growth in heap memory in use while doing so.
+struct FlagProfile {
+  // nullptr for the totals of a type.
+  const FlagInfo* flag;
+  const char* type;
+  uint64_t calls;
+  uint64_t ns;
+  int64_t heap_bytes;
+};
+
+// Time spent by `parse`, in nanoseconds.
+struct ParseProfile {
+  uint64_t total_ns = 0;
+
+  // Finding options by name.
+  uint64_t match_ns = 0;
+
+  // Parsing values, i.e. the sum over `flags`.
+  uint64_t parse_ns = 0;
+
+  // Reading environment variables; see `environment_prefix`.
+  uint64_t environment_ns = 0;
+
+  // Rendering `--help` output.
+  uint64_t help_ns = 0;
+
+  // Growth in heap memory in use while parsing values, on glibc.
+  int64_t heap_bytes = 0;
+
+  // Flags that were set, in registry order, and the totals for their types.
+  std::vector<FlagProfile> flags;
+  std::vector<FlagProfile> types;
+};
+
+// If not nullptr, `parse` measures the time it spends and passes the result
+// to this function before returning.  Defaults to nullptr.
+//
+// Profiling can also be enabled with the `--xflags_profile` option, which
+// makes `parse` print the result as JSON to stderr.  Timing starts early
+// enough to cover the whole command line only if the option is given in
+// full, before any `--`.
+extern void (*profile_handler)(const ParseProfile& profile);
+
 // Parses a command line.  If you use this function, you don't need to call
 // `get_options`, `parse_flag`, or `print_help` yourself.
 //
 // In addition to all the options exported with `XFLAGS_EXPORT()`, this
-// function adds a `--help` option.
+// function adds the `--help`, `--flagfile` and `--xflags_profile` options.
 //
 // This function will exit if one of the command line arguments is `--help`.
+//
+// In programs with up to 4096 flags, this function does not allocate memory
+// unless flags whose parsers allocate, like lists or long strings, are set.
+// Setting `environment_prefix`, enabling profiling and `--help` also
+// allocate memory.
 void parse(int argc, char** argv);
 
 // Returns all configured flags for use with getopt_long().
@@ -43,14 +118,184 @@ std::vector<option> get_options(int val_base = 0);
 // library.
 void parse_flag(int val, const char* optarg);
 
+// Flag values parsed by `FlagSet::parse`.  Only the flags that were set are
+// stored; the others read as the current values of the exported variables.
+//
+// Reusing one object for several calls saves allocating its storage again.
+class FlagValues {
+ public:
+  FlagValues() = default;
+  FlagValues(FlagValues&& other) noexcept;
+  FlagValues& operator=(FlagValues&& other) noexcept;
+  ~FlagValues();
+
+  FlagValues(const FlagValues&) = delete;
+  FlagValues& operator=(const FlagValues&) = delete;
+
+  // Returns the value that the exported variable `flag` has in this set.
+  template <typename T>
+  const T& get(const T& flag) const {
+    const void* value = find(&flag);
+    return value ? *static_cast<const T*>(value) : flag;
+  }
+
+  // Returns true if the exported variable `flag` was set.
+  bool has(const void* flag) const { return find(flag) != nullptr; }
+
+  // The non-option arguments, in order.
+  const std::vector<const char*>& arguments() const { return arguments_; }
+
+  // Removes all values and arguments.
+  void clear();
+
+ private:
+  friend class FlagSet;
+
+  struct Value {
+    const void* flag;
+    void* data;
+    bool (*parse)(void* target, const char* string, const char** endptr);
+    void (*destroy)(void* data);
+    int val;
+  };
+
+  struct Block {
+    std::unique_ptr<std::max_align_t[]> data;
+    size_t size;
+  };
+
+  const void* find(const void* flag) const;
+
+  // Returns storage for a value of `size` bytes.
+  void* allocate(size_t size);
+
+  std::vector<Value> values_;
+  std::vector<const char*> arguments_;
+
+  // Storage for the values, kept for reuse by `clear`.  `block_used_` units
+  // of `blocks_[block_]` are in use.
+  std::vector<Block> blocks_;
+  size_t block_ = 0;
+  size_t block_used_ = 0;
+
+  // The position in `values_` of each flag position, once there are too many
+  // values to search.  Entries may be stale, and are checked against `val`.
+  std::vector<uint32_t> index_;
+};
+
+// Parses command lines into `FlagValues` instead of the exported variables,
+// using the flags exported with `XFLAGS_EXPORT()` as the schema.  Unlike
+// `parse`, this neither changes global state nor exits, so any number of
+// threads may parse command lines at the same time.
+//
+// Only flags whose types can be copied are supported; `Reloadable`, `Lazy`,
+// `Shared` and `MappedArray` flags are reported as errors.  The built-in
+// options of `parse` are not recognized.  Flags of shared libraries and
+// plugins are known once `parse`, `get_options` or `register_loaded_flags`
+// added them.
+class FlagSet {
+ public:
+  // Parses `argv`, whose first element is the program name, into `values`,
+  // which is cleared first.  Non-option arguments are collected, and all
+  // arguments after `--` are non-options.  Returns false and describes the
+  // problem in `error` on failure.
+  //
+  // Flag values may point into the strings of `argv`, which must outlive
+  // `values`.
+  bool parse(int argc, const char* const* argv, FlagValues& values,
+             std::string& error) const;
+};
+
 // Prints help output.
 //
-// Handles basic word-wrapping and line breaks.
+// Handles basic word-wrapping and line breaks.  The text is written with a
+// single write(2) when `std::cout` writes to standard output, and otherwise
+// with a single `std::cout.write()`.
 void print_help();
 
-#define XFLAGS_SECTION __attribute__((section(".xflags")))
+// Prints a description of all flags as a JSON array, as for `--help=json`.
+// Each element holds the name, placeholder, type, file and description of a
+// flag.
+void print_help_json();
+
+// Writes the values of all flags whose types support it (see `Snapshot`) to
+// `path`, keyed by flag name and source file.  Returns false and calls
+// `error_handler` on failure.
+bool save_snapshot(const char* path);
+
+// Restores flag values from a file written by `save_snapshot`.  Entries that
+// match no flag, or whose type differs from that of the flag, are reported
+// through `error_handler`, and make this function return false.  The
+// `--flagsnapshot=FILE` option added by `parse` calls this function.
+bool load_snapshot(const char* path);
+
+// Writes a snapshot of all flag values to a sealed, read-only shared memory
+// file, for processes that parse flags once and then fork or spawn workers.
+// `Shared` flags of this process are pointed at the file, and the same
+// happens in processes calling `attach_shared` with the descriptor, or given
+// `--flagsnapshot=/proc/self/fd/N`, so that their values occupy the same
+// physical pages.  Returns the file descriptor, which is inherited by child
+// processes, or -1 on failure.
+int publish_shared();
+
+// Restores the flag values published by `publish_shared` in another process.
+// Returns false on failure.
+bool attach_shared(int fd);
+
+// Adds the flags exported by shared libraries and plugins loaded since the
+// last call, and returns how many were added.  Called by `parse` and
+// `get_options`, so it's only needed for plugins loaded with dlopen(3) after
+// those, and in programs that only use `FlagSet`.  Other threads may use
+// `FlagSet` meanwhile; the tables this replaces are freed by `reclaim`.
+//
+// The flags of the program or library linking this library come first,
+// followed by those of other objects in the order they were loaded.  When
+// several objects export flags with the same name, the first one is used.
+// Objects whose flags were added must not be unloaded.
+size_t register_loaded_flags();
+
+// Re-reads `path` as a flag file whenever the process receives SIGHUP or the
+// file is written or replaced, and publishes the new values of all
+// `Reloadable` flags it sets.  Other flags in the file are ignored.  The file
+// is watched from the time this function returns, by a background thread it
+// starts.  A relative `path` is resolved against the current directory.
+//
+// If the file contains errors, they are reported to stderr and no values are
+// published.
+void enable_reload(const char* path);
+
+// Reloads the flag file given to `enable_reload` right away.  Returns false
+// if the file contains errors, in which case no values are published.
+bool reload();
+
+// Frees the values replaced by reloads so far, and the flag tables replaced
+// when `register_loaded_flags` added flags.  Only call this when no thread
+// holds a reference obtained from a `Reloadable` before the last reload, or
+// is still in a `FlagSet` or `FlagValues` call started before flags were
+// last added.
+void reclaim();
+
+// Makes the storage of flags declared with `XFLAGS_DATA` read-only, so that
+// writes to them crash the program instead of going unnoticed.  Call this
+// once flags are no longer set, e.g. right after `parse`.  Only whole pages
+// holding nothing but such flags are protected.  Returns false on failure,
+// with `errno` set.
+bool protect_data();
+
 #define XFLAGS_NAME_SECTION __attribute__((section(".xflags-names")))
 
+// Places a flag variable in the `xflags_data` section, which only holds flag
+// values, so that flags read in hot loops share cache lines with each other
+// rather than with data that's written often.  The section starts at a cache
+// line boundary, and at a page boundary in programs calling `protect_data`.
+// Not for `Reloadable`, `Lazy` or `Shared` flags, which change after parsing.
+//
+// Example:
+//
+//     int width XFLAGS_DATA = 80;
+//     XFLAGS_EXPORT(width, "COLS", "set output width to COLS");
+#define XFLAGS_DATA __attribute__((section("xflags_data")))
+
 // Exports a variable so that it can be set from the command line.
 //
 // Example:
@@ -62,32 +307,353 @@ void print_help();
 //                   "show times using style STYLE:\n"
 //                   "full-iso: YYYY-MM-DDTHH:MM:SS\n"
 //                   "+FORMAT: custom format");
+//
+// Exporting two flags with the same name from one namespace of a program or
+// library fails to link, since each defines a symbol named after the flag.
 #define XFLAGS_EXPORT(var_name, var_placeholder, var_description)          \
   static_assert(::xflags::Parser<decltype(var_name)>::ok,                  \
                 "No parser for type");                                     \
-  extern const char xflags__name_##var_name[] XFLAGS_NAME_SECTION;         \
+  extern const char xflags__name_##var_name[] XFLAGS_NAME_SECTION          \
+      __attribute__((visibility("hidden")));                               \
   const char xflags__name_##var_name[] XFLAGS_NAME_SECTION = #var_name;    \
-  static const ::xflags::FlagInfo xflags__info_##var_name = {              \
-      .name = xflags__name_##var_name,                                     \
-      .parse = ::xflags::Parser<decltype(var_name)>::parse,                \
-      .description = var_description,                                      \
-      .placeholder = var_placeholder,                                      \
-      .file = __FILE__,                                                    \
-      .requires_argument =                                                 \
-          ::xflags::Parser<decltype(var_name)>::requires_argument,         \
-      .data = reinterpret_cast<void*>(&var_name)};                         \
-  extern const ::xflags::FlagInfo* const xflags_##var_name XFLAGS_SECTION; \
-  const ::xflags::FlagInfo* const xflags_##var_name XFLAGS_SECTION =       \
-      &xflags__info_##var_name;
+  static void xflags__bind_##var_name(::xflags::FlagBinding& binding) {    \
+    ::xflags::bind_flag(var_name, binding);                                \
+  }                                                                        \
+  static void __attribute__((used, noinline)) xflags__info_##var_name() {  \
+    asm(XFLAGS_INFO_ASM                                                    \
+        :                                                                  \
+        : "i"(xflags__name_##var_name), "i"(var_description),              \
+          "i"(::xflags::string_or_empty(var_placeholder)), "i"(__FILE__),  \
+          "i"(&xflags__bind_##var_name),                                   \
+          "i"(::xflags::flag_traits<decltype(var_name)>(var_placeholder)));\
+  }
 
-struct FlagInfo {
-  const char* name;
-  bool (*parse)(void* target, const char* string, const char** endptr);
-  const char* description;
-  const char* placeholder;
-  const char* file;
-  const bool requires_argument;
+// Emits a `FlagInfo` into the `xflags` section.  Each offset is computed by
+// the assembler relative to the field holding it, which needs no relocation
+// in position-independent programs or libraries.  The linker defines the
+// `__start_xflags` and `__stop_xflags` symbols bounding the section, so
+// flags are found in any link order, and the section is kept when linking
+// with --gc-sections.
+//
+// The first flag of each translation unit also emits an ELF note holding the
+// offsets of the section bounds, in a COMDAT group so that each program or
+// shared library ends up with one.  This is how `register_loaded_flags`
+// finds the flags of other loaded objects.
+#define XFLAGS_INFO_ASM                 \
+  XFLAGS_NOTE_ASM                       \
+  ".pushsection xflags,\"a\"\n"         \
+  ".balign 4\n"                         \
+  "0:\n"                                \
+  ".long %c0 - 0b\n"                    \
+  ".long %c1 - (0b + 4)\n"              \
+  ".long %c2 - (0b + 8)\n"              \
+  ".long %c3 - (0b + 12)\n"             \
+  ".long %c4 - (0b + 16)\n"             \
+  ".long %c5\n"                         \
+  ".popsection"
+
+// The note found by `register_loaded_flags`: name "xflags", type 1, and the
+// offsets of `__start_xflags` and `__stop_xflags` from the fields holding
+// them.  Nothing refers to the note, so it's marked to be kept by
+// --gc-sections where the toolchain supports that; it then keeps the
+// `xflags` section of shared libraries too.
+#if defined(__has_attribute)
+#if __has_attribute(retain)
+#define XFLAGS_NOTE_SECTION_FLAGS "aGR"
+#endif
+#endif
+#ifndef XFLAGS_NOTE_SECTION_FLAGS
+#define XFLAGS_NOTE_SECTION_FLAGS "aG"
+#endif
+
+#define XFLAGS_NOTE_ASM                                             \
+  ".ifndef .Lxflags_note\n"                                         \
+  ".pushsection .note.xflags,\"" XFLAGS_NOTE_SECTION_FLAGS          \
+  "\",%%note,xflags_note,comdat\n"                                  \
+  ".balign 4\n"                                                     \
+  ".Lxflags_note:\n"                                                \
+  ".long 7, 8, 1\n"                                                 \
+  ".asciz \"xflags\"\n"                                             \
+  ".balign 4\n"                                                     \
+  ".hidden __start_xflags\n"                                        \
+  ".hidden __stop_xflags\n"                                         \
+  ".long __start_xflags - (.Lxflags_note + 20)\n"                   \
+  ".long __stop_xflags - (.Lxflags_note + 24)\n"                    \
+  ".popsection\n"                                                   \
+  ".endif\n"
+
+// The parts of a flag's description that are addresses the linker can't
+// express as offsets, such as those of template functions defined in other
+// libraries.  Filled in by `FlagInfo::bind`.
+struct FlagBinding {
   void* data;
+  bool (*parse)(void* target, const char* string, const char** endptr);
+  const char* (*type)();
+
+  // Snapshot support; see `Snapshot`.  nullptr for unsupported types.
+  void (*save)(const void* data, std::string& out);
+  bool (*load)(void* data, const char* payload, size_t size);
+
+  // Copies of the flag for `FlagSet`, `size` bytes large.  `copy` constructs
+  // one at `target` and is nullptr for types that can't be copied.
+  size_t size;
+  void (*copy)(void* target, const void* source);
+  void (*destroy)(void* target);
+};
+
+// Description of an exported flag, as emitted by `XFLAGS_EXPORT`.  The
+// strings are stored as offsets from the fields holding them, so that the
+// `xflags` section is read-only and shared between processes running the
+// same program.
+struct FlagInfo {
+  static constexpr uint32_t kHasPlaceholder = 1;
+  static constexpr uint32_t kRequiresArgument = 2;
+  static constexpr uint32_t kReloadable = 4;
+  // `Shared` flags may point into a restored snapshot.
+  static constexpr uint32_t kShared = 8;
+
+  const char* name() const { return resolve<const char>(name_offset); }
+  const char* description() const {
+    return resolve<const char>(description_offset);
+  }
+  const char* placeholder() const {
+    return (traits & kHasPlaceholder) ? resolve<const char>(placeholder_offset)
+                                      : nullptr;
+  }
+  const char* file() const { return resolve<const char>(file_offset); }
+  bool requires_argument() const { return traits & kRequiresArgument; }
+  bool reloadable() const { return traits & kReloadable; }
+  bool shared() const { return traits & kShared; }
+
+  // Returns the address of the flag and the functions handling its type.
+  FlagBinding bind() const {
+    FlagBinding binding;
+    resolve<void(FlagBinding&)>(bind_offset)(binding);
+    return binding;
+  }
+
+  int32_t name_offset;
+  int32_t description_offset;
+  int32_t placeholder_offset;
+  int32_t file_offset;
+  int32_t bind_offset;
+  uint32_t traits;
+
+ private:
+  template <typename T>
+  static T* resolve(const int32_t& offset) {
+    return reinterpret_cast<T*>(reinterpret_cast<uintptr_t>(&offset) + offset);
+  }
+};
+
+static_assert(sizeof(FlagInfo) == 24, "FlagInfo must match XFLAGS_INFO_ASM");
+
+constexpr const char* string_or_empty(const char* string) {
+  return string ? string : "";
+}
+
+// Converts flag values to and from the payloads stored by `save_snapshot`.
+// Payloads are stored 8-byte aligned, in the byte order of the host.
+// Specialize this template to support more types.
+template <typename T, typename Enable = void>
+struct Snapshot {
+  static constexpr bool supported = false;
+  static void save(const void*, std::string&) {}
+  static bool load(void*, const char*, size_t) { return false; }
+};
+
+// Numbers are stored as their in-memory representation.
+template <typename T>
+struct Snapshot<T,
+                typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+  static constexpr bool supported = true;
+  static void save(const void* data, std::string& out) {
+    out.append(reinterpret_cast<const char*>(data), sizeof(T));
+  }
+  static bool load(void* data, const char* payload, size_t size) {
+    if (size != sizeof(T)) return false;
+    std::memcpy(data, payload, sizeof(T));
+    return true;
+  }
+};
+
+// Bools are stored as one byte, 0 or 1.  Other bytes aren't valid bools, and
+// are rejected.
+template <>
+struct Snapshot<bool> {
+  static constexpr bool supported = true;
+  static void save(const void* data, std::string& out) {
+    out += *reinterpret_cast<const bool*>(data) ? '\1' : '\0';
+  }
+  static bool load(void* data, const char* payload, size_t size) {
+    if (size != 1 || static_cast<unsigned char>(*payload) > 1) return false;
+    *reinterpret_cast<bool*>(data) = *payload;
+    return true;
+  }
+};
+
+template <>
+struct Snapshot<std::string> {
+  static constexpr bool supported = true;
+  static void save(const void* data, std::string& out) {
+    out += *reinterpret_cast<const std::string*>(data);
+  }
+  static bool load(void* data, const char* payload, size_t size) {
+    reinterpret_cast<std::string*>(data)->assign(payload, size);
+    return true;
+  }
+};
+
+// Lists of numbers are stored as raw arrays, and restored with one memcpy.
+template <typename T>
+struct Snapshot<std::vector<T>,
+                typename std::enable_if<std::is_arithmetic<T>::value &&
+                                        !std::is_same<T, bool>::value>::type> {
+  static constexpr bool supported = true;
+  static void save(const void* data, std::string& out) {
+    const auto& values = *reinterpret_cast<const std::vector<T>*>(data);
+    out.append(reinterpret_cast<const char*>(values.data()),
+               values.size() * sizeof(T));
+  }
+  static bool load(void* data, const char* payload, size_t size) {
+    if (size % sizeof(T)) return false;
+    auto& values = *reinterpret_cast<std::vector<T>*>(data);
+    values.resize(size / sizeof(T));
+    if (size) std::memcpy(values.data(), payload, size);
+    return true;
+  }
+};
+
+// Lists of strings are stored as a 64-bit length followed by the bytes of
+// each string.
+template <>
+struct Snapshot<std::vector<std::string>> {
+  static constexpr bool supported = true;
+  static void save(const void* data, std::string& out) {
+    const auto& values =
+        *reinterpret_cast<const std::vector<std::string>*>(data);
+    for (const auto& value : values) {
+      const uint64_t length = value.size();
+      out.append(reinterpret_cast<const char*>(&length), sizeof(length));
+      out += value;
+    }
+  }
+  static bool load(void* data, const char* payload, size_t size) {
+    auto& values = *reinterpret_cast<std::vector<std::string>*>(data);
+    values.clear();
+    while (size > 0) {
+      uint64_t length;
+      if (size < sizeof(length)) return false;
+      std::memcpy(&length, payload, sizeof(length));
+      payload += sizeof(length);
+      size -= sizeof(length);
+      if (length > size) return false;
+      values.emplace_back(payload, length);
+      payload += length;
+      size -= length;
+    }
+    return true;
+  }
+};
+
+// Extracts the type from a `__PRETTY_FUNCTION__` string of `TypeName<T>`.
+std::string type_name_from_signature(const char* signature);
+
+// Provides the type name shown by `--help=json`.  For types without a
+// specialization, the name is taken from the compiler's description of this
+// function.  Specialize this template to choose a different name.
+template <typename T>
+struct TypeName {
+  static const char* get() {
+    static const std::string name =
+        type_name_from_signature(__PRETTY_FUNCTION__);
+    return name.c_str();
+  }
+};
+
+#define XFLAGS_DECLARE_TYPE_NAME(type, type_name)    \
+  template <>                                        \
+  struct TypeName<type> {                            \
+    static const char* get() { return type_name; } \
+  }
+
+XFLAGS_DECLARE_TYPE_NAME(bool, "bool");
+XFLAGS_DECLARE_TYPE_NAME(float, "float");
+XFLAGS_DECLARE_TYPE_NAME(double, "double");
+XFLAGS_DECLARE_TYPE_NAME(long double, "long double");
+XFLAGS_DECLARE_TYPE_NAME(int8_t, "int8");
+XFLAGS_DECLARE_TYPE_NAME(uint8_t, "uint8");
+XFLAGS_DECLARE_TYPE_NAME(int16_t, "int16");
+XFLAGS_DECLARE_TYPE_NAME(uint16_t, "uint16");
+XFLAGS_DECLARE_TYPE_NAME(int32_t, "int32");
+XFLAGS_DECLARE_TYPE_NAME(uint32_t, "uint32");
+XFLAGS_DECLARE_TYPE_NAME(int64_t, "int64");
+XFLAGS_DECLARE_TYPE_NAME(uint64_t, "uint64");
+XFLAGS_DECLARE_TYPE_NAME(std::string, "string");
+XFLAGS_DECLARE_TYPE_NAME(const char*, "string");
+#if __cplusplus >= 201703L
+XFLAGS_DECLARE_TYPE_NAME(std::string_view, "string");
+#endif
+
+template <typename U, typename Allocator>
+struct TypeName<std::vector<U, Allocator>> {
+  static const char* get() {
+    static const std::string name =
+        std::string("list<") + TypeName<U>::get() + ">";
+    return name.c_str();
+  }
+};
+
+template <typename U, typename Allocator>
+struct TypeName<std::deque<U, Allocator>>
+    : public TypeName<std::vector<U>> {};
+
+template <typename U, typename Compare, typename Allocator>
+struct TypeName<std::set<U, Compare, Allocator>> {
+  static const char* get() {
+    static const std::string name =
+        std::string("set<") + TypeName<U>::get() + ">";
+    return name.c_str();
+  }
+};
+
+template <typename U, typename Hash, typename Equal, typename Allocator>
+struct TypeName<std::unordered_set<U, Hash, Equal, Allocator>>
+    : public TypeName<std::set<U>> {};
+
+template <typename U, size_t N>
+struct TypeName<std::array<U, N>> {
+  static const char* get() {
+    static const std::string name = std::string("array<") +
+                                    TypeName<U>::get() + "," +
+                                    std::to_string(N) + ">";
+    return name.c_str();
+  }
+};
+
+template <typename K, typename V, typename Compare, typename Allocator>
+struct TypeName<std::map<K, V, Compare, Allocator>> {
+  static const char* get() {
+    static const std::string name = std::string("map<") +
+                                    TypeName<K>::get() + "," +
+                                    TypeName<V>::get() + ">";
+    return name.c_str();
+  }
+};
+
+template <typename K, typename V, typename Hash, typename Equal,
+          typename Allocator>
+struct TypeName<std::unordered_map<K, V, Hash, Equal, Allocator>>
+    : public TypeName<std::map<K, V>> {};
+
+template <typename T>
+struct is_reloadable {
+  static constexpr bool value = false;
+};
+
+template <typename T>
+struct is_shared {
+  static constexpr bool value = false;
 };
 
 template <typename T>
@@ -146,17 +712,237 @@ struct Parser<std::basic_string<Char, Traits, Allocator>> : public ScalarParser
   }
 };
 
-// Parser for container types.  To add multiple values to a container, use the
-// same option multiple times, e.g. --foo=1 --foo=2 --foo=3.
+// Parser for const char*.  The flag points into the argument instead of
+// holding a copy, so no memory is allocated.  Arguments given to `parse`
+// and the flag files it reads are never freed, but values taken from the
+// environment are only valid until it changes.
+template <>
+struct Parser<const char*> : public ScalarParser {
+  static bool parse(void* target, const char* string, const char** endptr) {
+    *reinterpret_cast<const char**>(target) = string;
+    *endptr = string + std::char_traits<char>::length(string);
+    return true;
+  }
+};
+
+#if __cplusplus >= 201703L
+// Parser for std::string_view, which points into the argument like
+// `const char*`.
+template <>
+struct Parser<std::string_view> : public ScalarParser {
+  static bool parse(void* target, const char* string, const char** endptr) {
+    const auto length = std::char_traits<char>::length(string);
+    *reinterpret_cast<std::string_view*>(target) =
+        std::string_view(string, length);
+    *endptr = string + length;
+    return true;
+  }
+};
+#endif
+
+// True for types whose values point into the parsed argument, including
+// containers of them.
+template <typename T, typename Enable = void>
+struct is_view {
+  static constexpr bool value = false;
+};
+
+template <>
+struct is_view<const char*> {
+  static constexpr bool value = true;
+};
+
+#if __cplusplus >= 201703L
+template <>
+struct is_view<std::string_view> {
+  static constexpr bool value = true;
+};
+#endif
+
+template <typename K, typename V>
+struct is_view<std::pair<K, V>> {
+  static constexpr bool value =
+      is_view<typename std::remove_const<K>::type>::value ||
+      is_view<typename std::remove_const<V>::type>::value;
+};
+
+template <typename T>
+struct is_view<T, typename std::enable_if<!std::is_same<
+                      typename T::value_type, char>::value>::type>
+    : public is_view<typename std::remove_const<typename T::value_type>::type> {
+};
+
+// Parsers for container types.  To add multiple values to a container, use
+// the same option multiple times, e.g. --foo=1 --foo=2 --foo=3.
 //
 // If the underlying data type cannot contain commas, --foo=1,2,3 will also
-// work.
+// work.  Room for all the values in an argument is reserved up front.
+
+// Returns the number of values in `string`, for reserving room in a
+// container, assuming values can't contain commas if `split`.
+inline size_t count_values(const char* string, bool split) {
+  size_t result = 1;
+  if (split) {
+    for (; *string; ++string) result += (*string == ',');
+  }
+  return result;
+}
+
+// True if values of `T` end at the first comma, so that arguments holding
+// several of them can be counted before parsing.
+template <typename T>
+struct splits_at_comma {
+  static constexpr bool value =
+      std::is_arithmetic<T>::value && !std::is_same<T, bool>::value;
+};
+
+// Makes room for `count` more elements in `target`, growing geometrically so
+// that repeated options don't reallocate each time.
+template <typename Container>
+inline auto reserve_values(Container& target, size_t count, int)
+    -> decltype(target.capacity(), void()) {
+  const auto size = target.size() + count;
+  if (size > target.capacity())
+    target.reserve(std::max(size, 2 * target.capacity()));
+}
+
+template <typename Container>
+inline auto reserve_values(Container& target, size_t count, long)
+    -> decltype(target.bucket_count(), void()) {
+  const auto size = target.size() + count;
+  if (size > target.bucket_count() * target.max_load_factor())
+    target.reserve(std::max(size, 2 * target.size()));
+}
+
+template <typename Container>
+inline void reserve_values(Container&, size_t, ...) {}
+
+// Parses a value of type `T` into `target`.  Strings end at `delimiter`
+// rather than at the end of `string`.
+template <typename T>
+inline bool parse_delimited(T& target, const char* string,
+                            char /* delimiter */, const char** endptr) {
+  return Parser<T>::parse(&target, string, endptr);
+}
+
+inline bool parse_delimited(std::string& target, const char* string,
+                            char delimiter, const char** endptr) {
+  const char* end = string;
+  while (*end && *end != delimiter) ++end;
+  target.assign(string, end);
+  *endptr = end;
+  return true;
+}
+
+// Booleans end at `delimiter` too, so that they can be map and array values.
+inline bool parse_delimited(bool& target, const char* string, char delimiter,
+                            const char** endptr) {
+  const char* end = string;
+  while (*end && *end != delimiter) ++end;
+  const size_t length = end - string;
+  if ((length == 1 && *string == '1') ||
+      (length == 4 && 0 == std::char_traits<char>::compare(string, "true", 4)))
+    target = true;
+  else if ((length == 1 && *string == '0') ||
+           (length == 5 &&
+            0 == std::char_traits<char>::compare(string, "false", 5)))
+    target = false;
+  else
+    return false;
+  *endptr = end;
+  return true;
+}
+
+#if __cplusplus >= 201703L
+inline bool parse_delimited(std::string_view& target, const char* string,
+                            char delimiter, const char** endptr) {
+  const char* end = string;
+  while (*end && *end != delimiter) ++end;
+  target = std::string_view(string, end - string);
+  *endptr = end;
+  return true;
+}
+#endif
+
+// Lists of numbers in arguments at least this many bytes long are parsed by
+// several threads.  The default is 1 MiB.
+extern size_t parallel_parse_threshold;
+
+// Parses the `length` bytes of comma separated values at `string` using
+// several threads, with `parse` parsing each value.  Once the values are
+// counted, calls `allocate(context, count)` for room for them.  Returns
+// false or sets `endptr` like the serial parsers would on error, and sets
+// `parsed` to the number of values the serial parsers would have added.
+// Internal use only.
+bool parse_list_in_parallel(const char* string, size_t length,
+                            size_t element_size,
+                            bool (*parse)(void* target, const char* string,
+                                          const char** endptr),
+                            void* (*allocate)(void* context, size_t count),
+                            void* context, size_t& parsed,
+                            const char** endptr);
+
+template <typename T>
+void* allocate_values(void* context, size_t count) {
+  auto& values = *reinterpret_cast<std::vector<T>*>(context);
+  const auto size = values.size();
+  values.resize(size + count);
+  return &values[size];
+}
+
+// Appends the values in `string` to `values` using `parse_list_in_parallel`.
+template <typename T>
+inline bool parse_in_parallel(std::vector<T>& values, const char* string,
+                              size_t length, const char** endptr) {
+  const auto size = values.size();
+  size_t parsed = 0;
+  const auto ok = parse_list_in_parallel(string, length, sizeof(T),
+                                         Parser<T>::parse, allocate_values<T>,
+                                         &values, parsed, endptr);
+  values.resize(size + parsed);
+  return ok;
+}
+
+// Returns true if `string` should go to `parse_in_parallel`, and sets
+// `length`.
+template <typename T>
+inline bool use_parallel_parse(const char* string, size_t& length) {
+  if (!splits_at_comma<T>::value) return false;
+  length = std::char_traits<char>::length(string);
+  return length >= parallel_parse_threshold;
+}
+
+// Appends the values in `string` to `target` using `parse_in_parallel`.
+template <typename Container>
+inline bool append_in_parallel(Container& target, const char* string,
+                               size_t length, const char** endptr) {
+  std::vector<typename Container::value_type> values;
+  const auto ok = parse_in_parallel(values, string, length, endptr);
+  target.insert(target.end(), values.begin(), values.end());
+  return ok;
+}
+
+template <typename T>
+inline bool append_in_parallel(std::vector<T>& target, const char* string,
+                               size_t length, const char** endptr) {
+  return parse_in_parallel(target, string, length, endptr);
+}
+
+// Appends values to a sequence container, like std::vector or std::deque.
 template <typename Container>
 inline bool parse_into_container(Container& target, const char* string,
                                  const char** endptr) {
   using ValueType = typename Container::value_type;
 
-  static_assert(Parser<ValueType>::scalar, "No parser for vector value type");
+  static_assert(Parser<ValueType>::scalar,
+                "No parser for container value type");
+
+  size_t length;
+  if (use_parallel_parse<ValueType>(string, length))
+    return append_in_parallel(target, string, length, endptr);
+
+  reserve_values(
+      target, count_values(string, splits_at_comma<ValueType>::value), 0);
 
   for (;;) {
     target.emplace_back();
@@ -167,25 +953,574 @@ inline bool parse_into_container(Container& target, const char* string,
   }
 }
 
-// TODO(mortehu): Is there a way to rewrite this so that it works with any
-// container type?
-template <typename U>
-struct Parser<std::vector<U>> {
+// Inserts values into a set, like std::set or std::unordered_set.
+template <typename Container>
+inline bool parse_into_set(Container& target, const char* string,
+                           const char** endptr) {
+  using ValueType = typename Container::value_type;
+
+  static_assert(Parser<ValueType>::scalar, "No parser for set value type");
+
+  size_t length;
+  if (use_parallel_parse<ValueType>(string, length)) {
+    std::vector<ValueType> values;
+    const auto ok = parse_in_parallel(values, string, length, endptr);
+    reserve_values(target, values.size(), 0);
+    target.insert(values.begin(), values.end());
+    return ok;
+  }
+
+  reserve_values(
+      target, count_values(string, splits_at_comma<ValueType>::value), 0);
+
+  for (;;) {
+    ValueType value;
+    const auto ok = Parser<ValueType>::parse(&value, string, endptr);
+    if (!ok) return false;
+    target.insert(target.end(), std::move(value));
+    if (**endptr != ',') return true;
+    string = *endptr + 1;
+  }
+}
+
+// Inserts key=value pairs into a map, like std::map or std::unordered_map.
+// String keys end at '=' and string values at ','.  A key given more than
+// once gets the last value.
+template <typename Container>
+inline bool parse_into_map(Container& target, const char* string,
+                           const char** endptr) {
+  using KeyType = typename Container::key_type;
+  using MappedType = typename Container::mapped_type;
+
+  static_assert(Parser<KeyType>::scalar && Parser<MappedType>::scalar,
+                "No parser for map key or value type");
+  static_assert(!std::is_same<KeyType, const char*>::value &&
+                    !std::is_same<MappedType, const char*>::value,
+                "const char* can't end at a delimiter; use std::string_view");
+
+  reserve_values(target, count_values(string, true), 0);
+
+  for (;;) {
+    KeyType key;
+    if (!parse_delimited(key, string, '=', endptr) || **endptr != '=')
+      return false;
+
+    MappedType value;
+    if (!parse_delimited(value, *endptr + 1, ',', endptr)) return false;
+
+    target[std::move(key)] = std::move(value);
+
+    if (**endptr != ',') return true;
+    string = *endptr + 1;
+  }
+}
+
+// Base class for container parsers, where `Function` is one of the functions
+// above.
+template <typename Container,
+          bool (*Function)(Container&, const char*, const char**)>
+struct ContainerParser {
   static constexpr bool ok = true;
   static constexpr bool scalar = false;
   static constexpr bool requires_argument = true;
 
   static bool parse(void* target, const char* string, const char** endptr) {
-    auto& vector = *reinterpret_cast<std::vector<U>*>(target);
-    return parse_into_container(*reinterpret_cast<std::vector<U>*>(target),
-                                string, endptr);
+    return Function(*reinterpret_cast<Container*>(target), string, endptr);
   }
 };
 
-// Internal use only.
-extern const FlagInfo* begin;
-extern const FlagInfo* end;
+template <typename U, typename Allocator>
+struct Parser<std::vector<U, Allocator>>
+    : public ContainerParser<std::vector<U, Allocator>,
+                             parse_into_container<std::vector<U, Allocator>>> {
+};
+
+template <typename U, typename Allocator>
+struct Parser<std::deque<U, Allocator>>
+    : public ContainerParser<std::deque<U, Allocator>,
+                             parse_into_container<std::deque<U, Allocator>>> {
+};
+
+template <typename U, typename Compare, typename Allocator>
+struct Parser<std::set<U, Compare, Allocator>>
+    : public ContainerParser<std::set<U, Compare, Allocator>,
+                             parse_into_set<std::set<U, Compare, Allocator>>> {
+};
+
+template <typename U, typename Hash, typename Equal, typename Allocator>
+struct Parser<std::unordered_set<U, Hash, Equal, Allocator>>
+    : public ContainerParser<
+          std::unordered_set<U, Hash, Equal, Allocator>,
+          parse_into_set<std::unordered_set<U, Hash, Equal, Allocator>>> {};
+
+template <typename K, typename V, typename Compare, typename Allocator>
+struct Parser<std::map<K, V, Compare, Allocator>>
+    : public ContainerParser<
+          std::map<K, V, Compare, Allocator>,
+          parse_into_map<std::map<K, V, Compare, Allocator>>> {};
+
+template <typename K, typename V, typename Hash, typename Equal,
+          typename Allocator>
+struct Parser<std::unordered_map<K, V, Hash, Equal, Allocator>>
+    : public ContainerParser<
+          std::unordered_map<K, V, Hash, Equal, Allocator>,
+          parse_into_map<std::unordered_map<K, V, Hash, Equal, Allocator>>> {};
+
+// Parser for std::array.  Each argument must hold exactly N values, and
+// string values end at ','.
+template <typename U, size_t N>
+struct Parser<std::array<U, N>> {
+  static constexpr bool ok = true;
+  static constexpr bool scalar = false;
+  static constexpr bool requires_argument = true;
+
+  static_assert(Parser<U>::scalar, "No parser for array value type");
+  static_assert(!std::is_same<U, const char*>::value,
+                "const char* can't end at a delimiter; use std::string_view");
+
+  static bool parse(void* target, const char* string, const char** endptr) {
+    auto& array = *reinterpret_cast<std::array<U, N>*>(target);
+    *endptr = string;
+    for (size_t i = 0; i < N; ++i) {
+      if (i > 0) {
+        if (**endptr != ',') return false;
+        string = *endptr + 1;
+      }
+      if (!parse_delimited(array[i], string, ',', endptr)) return false;
+    }
+    return true;
+  }
+};
+
+// Base class for `Reloadable`, tracking flags with values waiting to be
+// published.  Internal use only.
+class ReloadableBase {
+ public:
+  // Publishes the staged values of all flags, or discards them.
+  static void publish_staged();
+  static void discard_staged();
+
+ protected:
+  ReloadableBase() = default;
+  ReloadableBase(const ReloadableBase&) = delete;
+  ReloadableBase& operator=(const ReloadableBase&) = delete;
+
+  // Adds this flag to the list of flags with a staged value.
+  void stage();
+
+  // Queues `value` to be deleted by `reclaim()`.
+  template <typename T>
+  static void retire(const T* value) {
+    retire(value, [](const void* ptr) { delete static_cast<const T*>(ptr); });
+  }
+  static void retire(const void* value, void (*deleter)(const void*));
+
+ private:
+  virtual void publish() = 0;
+  virtual void discard() = 0;
+
+  ReloadableBase* next_staged_ = nullptr;
+};
+
+// A flag whose value may be replaced by `reload()` while other threads are
+// reading it.
+//
+// Readers get a reference to an immutable value through a single acquire
+// load, which is a plain MOV on x86.  A reload parses new values into
+// separate objects and swaps the pointers, so readers never see a partially
+// written value.  Replaced values stay valid until `reclaim()` is called.
+//
+// Container values start out empty for each reload rather than accumulating
+// across reloads.
+//
+// Example:
+//
+//     xflags::Reloadable<uint32_t> rate_limit(1000);
+//     XFLAGS_EXPORT(rate_limit, "QPS", "maximum number of queries per second");
+//
+//     if (qps > *rate_limit) ...
+template <typename T>
+class Reloadable : public ReloadableBase {
+  static_assert(!is_view<T>::value,
+                "Reloaded flag files are unmapped by reclaim(), so reloadable "
+                "values can't point into them");
+
+ public:
+  Reloadable() : default_(), current_(&default_) {}
+  Reloadable(T value) : default_(std::move(value)), current_(&default_) {}
+
+  const T& get() const { return *current_.load(std::memory_order_acquire); }
+  const T& operator*() const { return get(); }
+  const T* operator->() const { return &get(); }
+
+  // Returns the object the next value is parsed into.  Internal use only.
+  T* staged() {
+    if (!staged_) {
+      staged_ = new T(default_);
+      stage();
+    }
+    return staged_;
+  }
+
+ private:
+  void publish() override {
+    const T* previous = current_.exchange(staged_, std::memory_order_acq_rel);
+    if (previous != &default_) retire(previous);
+    staged_ = nullptr;
+  }
+
+  void discard() override {
+    delete staged_;
+    staged_ = nullptr;
+  }
+
+  const T default_;
+  std::atomic<const T*> current_;
+  T* staged_ = nullptr;
+};
+
+template <typename T>
+struct is_reloadable<Reloadable<T>> {
+  static constexpr bool value = true;
+};
+
+// Parser for reloadable flags.  Values are parsed by the parser for `T`, into
+// a staging object that is published once parsing is complete.
+template <typename T>
+struct Parser<Reloadable<T>> {
+  static constexpr bool ok = Parser<T>::ok;
+  static constexpr bool scalar = false;
+  static constexpr bool requires_argument = Parser<T>::requires_argument;
+
+  static bool parse(void* target, const char* string, const char** endptr) {
+    return Parser<T>::parse(reinterpret_cast<Reloadable<T>*>(target)->staged(),
+                            string, endptr);
+  }
+};
+
+// Reloadable flags are described by the type of their value.
+template <typename T>
+struct TypeName<Reloadable<T>> : public TypeName<T> {};
+
+// Base class for `Lazy`, tracking flags with values waiting to be parsed.
+class LazyBase {
+ public:
+  // Parses the values of all `Lazy` flags given so far, as done by
+  // `--xflags_validate_all`.
+  static void parse_all();
+
+  // Records a value to be parsed on first access.  Internal use only.
+  void record(const char* value);
+
+ protected:
+  LazyBase() = default;
+  LazyBase(const LazyBase&) = delete;
+  LazyBase& operator=(const LazyBase&) = delete;
+
+  // Parses the recorded values into `target` using `parse`, unless already
+  // done.  `flag` is the address of the exported variable, used to name it
+  // in error messages.
+  void materialize(bool (*parse)(void* target, const char* string,
+                                 const char** endptr),
+                   void* target, const void* flag) const;
+
+ private:
+  virtual void parse_now() const = 0;
+
+  std::vector<const char*> values_;
+  mutable std::once_flag once_;
+  LazyBase* next_recorded_ = nullptr;
+};
+
+// A flag whose value is only parsed when first read, for values that are
+// expensive to parse and often unused.  Parsing happens once, even if
+// several threads read the flag at the same time, and errors are reported
+// through `error_handler` at that point.  The `--xflags_validate_all` option
+// parses all such values during `parse` instead.
+//
+// The raw values must stay valid until parsed.  Values from the command line
+// and flag files do; values from the environment do unless it is modified.
+//
+// Example:
+//
+//     xflags::Lazy<std::vector<uint64_t>> blocked_ids;
+//     XFLAGS_EXPORT(blocked_ids, "IDS", "IDs to reject");
+//
+//     if (std::binary_search(blocked_ids->begin(), blocked_ids->end(), id)) ...
+template <typename T>
+class Lazy : public LazyBase {
+ public:
+  Lazy() : value_() {}
+  Lazy(T value) : value_(std::move(value)) {}
+
+  const T& get() const {
+    materialize(Parser<T>::parse, &value_, this);
+    return value_;
+  }
+  const T& operator*() const { return get(); }
+  const T* operator->() const { return &get(); }
+
+ private:
+  void parse_now() const override { get(); }
+
+  mutable T value_;
+};
+
+// Parser for lazy flags.  Values are recorded, and parsed by the parser for
+// `T` on first access.
+template <typename T>
+struct Parser<Lazy<T>> {
+  static constexpr bool ok = Parser<T>::ok;
+  static constexpr bool scalar = false;
+  static constexpr bool requires_argument = Parser<T>::requires_argument;
+
+  static bool parse(void* target, const char* string, const char** endptr) {
+    reinterpret_cast<Lazy<T>*>(target)->record(string);
+    *endptr = "";
+    return true;
+  }
+};
+
+template <typename T>
+struct TypeName<Lazy<T>> : public TypeName<T> {};
+
+// A read-only list of numbers or string, which can point at storage shared
+// between processes instead of a private copy.  `T` is a `std::vector` of
+// numbers or a `std::string`.  Values given on the command line are parsed
+// into a private copy; values restored by `attach_shared` or `--flagsnapshot`
+// point into the shared mapping instead.
+//
+// Example:
+//
+//     xflags::Shared<std::vector<uint64_t>> blocked_ids;
+//     XFLAGS_EXPORT(blocked_ids, "IDS", "IDs to reject");
+//
+//     if (std::binary_search(blocked_ids.begin(), blocked_ids.end(), id)) ...
+template <typename T>
+class Shared {
+ public:
+  using value_type = typename T::value_type;
+  using const_iterator = const value_type*;
+
+  static_assert((std::is_arithmetic<value_type>::value &&
+                 !std::is_same<value_type, bool>::value) ||
+                    std::is_same<T, std::string>::value,
+                "Shared supports lists of numbers and strings");
+
+  Shared() = default;
+  Shared(T value) : owned_(std::move(value)) {}
+  Shared(const Shared&) = delete;
+  Shared& operator=(const Shared&) = delete;
+
+  const value_type* data() const { return view_ ? view_ : owned_.data(); }
+  size_t size() const { return view_ ? view_size_ : owned_.size(); }
+  bool empty() const { return size() == 0; }
+  const_iterator begin() const { return data(); }
+  const_iterator end() const { return data() + size(); }
+  const value_type& operator[](size_t i) const { return data()[i]; }
+
+  // Points this flag at `size` values stored elsewhere.  Internal use only.
+  void view(const value_type* data, size_t size) {
+    T().swap(owned_);
+    view_ = data;
+    view_size_ = size;
+  }
+
+  // Returns the private copy of the value, making one if needed.  Internal
+  // use only.
+  T* owned() {
+    if (view_) {
+      owned_.assign(view_, view_ + view_size_);
+      view_ = nullptr;
+    }
+    return &owned_;
+  }
+
+ private:
+  T owned_;
+  const value_type* view_ = nullptr;
+  size_t view_size_ = 0;
+};
+
+template <typename T>
+struct is_shared<Shared<T>> {
+  static constexpr bool value = true;
+};
+
+template <typename T>
+struct Parser<Shared<T>> {
+  static constexpr bool ok = Parser<T>::ok;
+  static constexpr bool scalar = false;
+  static constexpr bool requires_argument = Parser<T>::requires_argument;
+
+  static bool parse(void* target, const char* string, const char** endptr) {
+    return Parser<T>::parse(reinterpret_cast<Shared<T>*>(target)->owned(),
+                            string, endptr);
+  }
+};
+
+template <typename T>
+struct TypeName<Shared<T>> : public TypeName<T> {};
+
+// Shared flags are stored like `T`, and restored by pointing at the payload.
+template <typename T>
+struct Snapshot<Shared<T>> {
+  using value_type = typename Shared<T>::value_type;
+
+  static constexpr bool supported = true;
+  static void save(const void* data, std::string& out) {
+    const auto& value = *reinterpret_cast<const Shared<T>*>(data);
+    out.append(reinterpret_cast<const char*>(value.data()),
+               value.size() * sizeof(value_type));
+  }
+  static bool load(void* data, const char* payload, size_t size) {
+    auto& value = *reinterpret_cast<Shared<T>*>(data);
+    if (size % sizeof(value_type)) return false;
+    // Payloads are only 8-byte aligned.
+    if (reinterpret_cast<uintptr_t>(payload) % alignof(value_type))
+      return Snapshot<T>::load(value.owned(), payload, size);
+    value.view(reinterpret_cast<const value_type*>(payload),
+               size / sizeof(value_type));
+    return true;
+  }
+};
+
+// Access hints for `MappedArray`, combined with `|`.
+enum MapHint : unsigned {
+  // Read the whole file into memory when mapping it (MAP_POPULATE).
+  kMapPopulate = 1,
+  // Start reading the file in the background (MADV_WILLNEED).
+  kMapWillNeed = 2,
+  // The values will be read in order (MADV_SEQUENTIAL).
+  kMapSequential = 4,
+  // The values will be read in random order (MADV_RANDOM).
+  kMapRandom = 8,
+};
+
+// Maps the file at `path` read-only, and checks that it holds a whole number
+// of values of `element_size` bytes aligned to `alignment`.  Returns the
+// mapping and sets `size` to its length in bytes, or reports the error
+// through `error_handler` and returns nullptr.  The mapping lives until the
+// process exits.  Internal use only.
+const void* map_array(const char* path, size_t element_size, size_t alignment,
+                      unsigned hints, size_t& size);
+
+// A read-only array of numbers, whose flag value is either a list of numbers
+// as for `std::vector<T>`, or `@PATH`, in which case the contents of the file
+// at PATH are mapped into memory and used without copying.  The file holds
+// the values in their in-memory representation.
+//
+// Example:
+//
+//     xflags::MappedArray<float> weights(xflags::kMapPopulate);
+//     XFLAGS_EXPORT(weights, "@FILE", "read model weights from FILE");
+//
+//     for (const auto weight : weights) ...
+template <typename T>
+class MappedArray : public Shared<std::vector<T>> {
+ public:
+  explicit MappedArray(unsigned hints = 0) : hints_(hints) {}
+
+  // Maps `path` and points this flag at its contents.  Internal use only.
+  bool map(const char* path) {
+    size_t size;
+    const auto data = map_array(path, sizeof(T), alignof(T), hints_, size);
+    if (!data) return false;
+    this->view(static_cast<const T*>(data), size / sizeof(T));
+    return true;
+  }
+
+ private:
+  unsigned hints_;
+};
+
+template <typename T>
+struct is_shared<MappedArray<T>> {
+  static constexpr bool value = true;
+};
+
+// Parser for mapped arrays.  Values not starting with `@` are parsed by the
+// parser for `std::vector<T>`.
+template <typename T>
+struct Parser<MappedArray<T>> {
+  static constexpr bool ok = Parser<std::vector<T>>::ok;
+  static constexpr bool scalar = false;
+  static constexpr bool requires_argument = true;
+
+  static bool parse(void* target, const char* string, const char** endptr) {
+    auto& array = *reinterpret_cast<MappedArray<T>*>(target);
+    if (*string != '@')
+      return Parser<std::vector<T>>::parse(array.owned(), string, endptr);
+    if (!array.map(string + 1)) return false;
+    *endptr = "";
+    return true;
+  }
+};
+
+template <typename T>
+struct TypeName<MappedArray<T>> : public TypeName<std::vector<T>> {};
+
+template <typename T>
+struct Snapshot<MappedArray<T>> : public Snapshot<Shared<std::vector<T>>> {};
+
+// Returns the `FlagInfo::traits` of a flag of type `T`.
+template <typename T>
+constexpr uint32_t flag_traits(const char* placeholder) {
+  return (placeholder ? FlagInfo::kHasPlaceholder : 0u) |
+         (Parser<T>::requires_argument ? FlagInfo::kRequiresArgument : 0u) |
+         (is_reloadable<T>::value ? FlagInfo::kReloadable : 0u) |
+         (is_shared<T>::value ? FlagInfo::kShared : 0u);
+}
+
+template <typename T>
+void copy_flag(void* target, const void* source) {
+  new (target) T(*static_cast<const T*>(source));
+}
+
+template <typename T>
+void destroy_flag(void* target) {
+  static_cast<T*>(target)->~T();
+}
+
+// Returns `copy_flag<T>`, or nullptr if `FlagValues` can't hold a `T`.
+template <typename T>
+constexpr typename std::enable_if<std::is_copy_constructible<T>::value &&
+                                      alignof(T) <= alignof(std::max_align_t),
+                                  void (*)(void*, const void*)>::type
+flag_copier() {
+  return copy_flag<T>;
+}
+
+template <typename T>
+constexpr typename std::enable_if<!(std::is_copy_constructible<T>::value &&
+                                    alignof(T) <= alignof(std::max_align_t)),
+                                  void (*)(void*, const void*)>::type
+flag_copier() {
+  return nullptr;
+}
+
+// Fills in the `FlagBinding` of `flag`.
+template <typename T>
+void bind_flag(T& flag, FlagBinding& binding) {
+  binding.data = &flag;
+  binding.parse = Parser<T>::parse;
+  binding.type = TypeName<T>::get;
+  binding.save = Snapshot<T>::supported ? Snapshot<T>::save : nullptr;
+  binding.load = Snapshot<T>::supported ? Snapshot<T>::load : nullptr;
+  binding.size = sizeof(T);
+  binding.copy = flag_copier<T>();
+  binding.destroy = destroy_flag<T>;
+}
 
 }  // namespace xflags
 
+// Bounds of the `xflags` section, defined by the linker.  Weak, so that
+// programs without flags link too.  Internal use only.
+extern "C" {
+extern const ::xflags::FlagInfo __start_xflags[]
+    __attribute__((weak, visibility("hidden")));
+extern const ::xflags::FlagInfo __stop_xflags[]
+    __attribute__((weak, visibility("hidden")));
+}
+
 #endif  // !XFLAGS_H_
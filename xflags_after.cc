@@ -1,3 +0,0 @@
-#include "xflags.h"
-
-const ::xflags::FlagInfo* ::xflags::end XFLAGS_SECTION = nullptr;